@@ -0,0 +1,929 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Userspace benchmark for the MOTU protocol encoders and decoders
+ *
+ *   Runs the code from motu_codec.c on synthetic traffic, and optionally
+ *   on captured packets, and reports bytes/sec and ns/event.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../motu_codec.h"
+#include "traffic.h"
+
+#define PROT2_PACKET (4 * 14) // NUM_ISO frames of the driver
+
+typedef void (*decode_fn)(struct motu_codec *codec, const unsigned char *buf,
+			  unsigned int buf_len);
+
+struct bench_ctx {
+	struct midi_stream *src; // encoder input, one per port
+	unsigned long long rx_bytes;
+	unsigned long long rx_events;
+	unsigned long long rx_calls; // deliveries, one rawmidi wakeup each
+	struct midi_stream *capture; // decoder output, one per port
+};
+
+static double min_time = 1.0;
+static unsigned int in_buf_size = MOTU_IN_BUF_SIZE;
+static unsigned char *in_bufs;
+static unsigned int out_buf_size = MOTU_OUT_BUF_SIZE;
+static unsigned char *out_bufs;
+static bool running_status = true;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_receive(struct motu_codec *codec, int port,
+			  const unsigned char *buf, int len)
+{
+	struct bench_ctx *ctx = codec->private_data;
+	int i;
+
+	ctx->rx_bytes += len;
+	ctx->rx_calls++;
+	for (i = 0; i < len; i++)
+		if (buf[i] & 0x80 && buf[i] != 0xf7)
+			ctx->rx_events++;
+
+	if (ctx->capture) {
+		struct midi_stream *ms = &ctx->capture[port];
+
+		ms->data = realloc(ms->data, ms->len + len);
+		memcpy(ms->data + ms->len, buf, len);
+		ms->len += len;
+	}
+}
+
+static int bench_transmit(struct motu_codec *codec, int port,
+			  unsigned char *buf, int len)
+{
+	struct bench_ctx *ctx = codec->private_data;
+	struct midi_stream *ms = &ctx->src[port];
+
+	if ((size_t)len > ms->len - ms->pos)
+		len = ms->len - ms->pos;
+	memcpy(buf, ms->data + ms->pos, len);
+	return len;
+}
+
+static void bench_transmit_ack(struct motu_codec *codec, int port,
+			       const unsigned char *buf, int len)
+{
+	struct bench_ctx *ctx = codec->private_data;
+
+	ctx->src[port].pos += len;
+}
+
+static const struct motu_codec_ops bench_ops = {
+	.receive = bench_receive,
+	.transmit = bench_transmit,
+	.transmit_ack = bench_transmit_ack,
+};
+
+static void bench_codec_init(struct motu_codec *codec, int n_ports,
+			     struct bench_ctx *ctx)
+{
+	motu_codec_init(codec, n_ports, n_ports, in_bufs, in_buf_size,
+			out_bufs, out_buf_size, &bench_ops, ctx);
+	codec->running_status = running_status;
+}
+
+static void report(const char *what, const char *label, unsigned long passes,
+		   unsigned long long bytes, unsigned long long events,
+		   double elapsed)
+{
+	printf("%-7s %-20s %8lu passes %10.2f MB/s %10.2f ns/event\n", what,
+	       label, passes, bytes / elapsed / 1e6,
+	       events ? elapsed * 1e9 / events : 0.0);
+}
+
+/* the bit by bit protocol 1 decoder that the mask table replaced */
+static void decode_prot1_bitloop(struct motu_codec *codec,
+				 const unsigned char *buf, unsigned int buf_len)
+{
+	unsigned int i;
+
+	// parsing state machine
+	int in_data = 0;
+	uint8_t mask = 0;
+	uint8_t chan = 0;
+
+	if (buf_len < 2)
+		return;
+
+	for (i = 2; i < buf_len; i++) {
+		if (in_data) {
+			for (; chan < 8 && mask != 0; chan++) {
+				if ((mask & 1) != 0) {
+					motu_in_port_write_byte(codec, chan,
+								buf[i]);
+					mask >>= 1;
+					chan++;
+					break;
+				}
+				mask >>= 1;
+			}
+			if (mask == 0) {
+				in_data = 0;
+			}
+		} else {
+			in_data = 1;
+			chan = 0;
+			mask = buf[i];
+			if (mask == 0) {
+				in_data = 0;
+			}
+		}
+	}
+
+	motu_codec_flush_input(codec);
+}
+
+static void decode_all(struct motu_codec *codec, decode_fn decode,
+		       const struct motu_packets *pk)
+{
+	int i;
+
+	for (i = 0; i < pk->count; i++)
+		decode(codec, pk->data + pk->off[i], pk->len[i]);
+}
+
+/* both decoders have to hand the same bytes to the same ports */
+static int compare_decode(const char *what, decode_fn a, decode_fn b,
+			  const struct motu_packets *pk, int n_ports)
+{
+	struct midi_stream out[2][MOTU_MAX_PORTS];
+	struct motu_codec codec;
+	struct bench_ctx ctx;
+	size_t total = 0, k;
+	int p, ret = 0;
+
+	memset(out, 0, sizeof(out));
+	memset(&ctx, 0, sizeof(ctx));
+
+	ctx.capture = out[0];
+	bench_codec_init(&codec, n_ports, &ctx);
+	decode_all(&codec, a, pk);
+
+	ctx.capture = out[1];
+	bench_codec_init(&codec, n_ports, &ctx);
+	decode_all(&codec, b, pk);
+
+	for (p = 0; p < MOTU_MAX_PORTS && !ret; p++) {
+		for (k = 0; k < out[0][p].len && k < out[1][p].len; k++)
+			if (out[0][p].data[k] != out[1][p].data[k])
+				break;
+		if (k != out[0][p].len || k != out[1][p].len) {
+			printf("%-7s MISMATCH on port %d at byte %zu\n", what,
+			       p, k);
+			ret = 1;
+		}
+		total += out[0][p].len;
+	}
+	if (!ret)
+		printf("%-7s identical output, %zu bytes\n", what, total);
+
+	for (p = 0; p < MOTU_MAX_PORTS; p++) {
+		midi_stream_free(&out[0][p]);
+		midi_stream_free(&out[1][p]);
+	}
+
+	return ret;
+}
+
+/* protocol 2 has no older decoder, so it has to give back its sources */
+static int compare_source(const char *what, decode_fn decode,
+			  const struct motu_packets *pk,
+			  const struct midi_stream *src, int n_ports)
+{
+	struct midi_stream out[MOTU_MAX_PORTS];
+	struct motu_codec codec;
+	struct bench_ctx ctx;
+	size_t total = 0, k;
+	int p, ret = 0;
+
+	memset(out, 0, sizeof(out));
+	memset(&ctx, 0, sizeof(ctx));
+
+	ctx.capture = out;
+	bench_codec_init(&codec, n_ports, &ctx);
+	decode_all(&codec, decode, pk);
+
+	for (p = 0; p < n_ports && !ret; p++) {
+		for (k = 0; k < out[p].len && k < src[p].len; k++)
+			if (out[p].data[k] != src[p].data[k])
+				break;
+		if (k != out[p].len || k != src[p].len) {
+			printf("%-7s MISMATCH on port %d at byte %zu\n", what,
+			       p, k);
+			ret = 1;
+		}
+		total += out[p].len;
+	}
+	if (!ret)
+		printf("%-7s same as the source, %zu bytes\n", what, total);
+
+	for (p = 0; p < MOTU_MAX_PORTS; p++)
+		midi_stream_free(&out[p]);
+
+	return ret;
+}
+
+static void run_decode(const char *what, decode_fn decode, const char *label,
+		       const struct motu_packets *pk, int n_ports)
+{
+	struct motu_codec codec;
+	struct bench_ctx ctx;
+	unsigned long passes = 0;
+	unsigned long long events;
+	double start, elapsed;
+
+	memset(&ctx, 0, sizeof(ctx));
+	bench_codec_init(&codec, n_ports, &ctx);
+
+	start = now();
+	do {
+		decode_all(&codec, decode, pk);
+		passes++;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	events = pk->events ? pk->events * passes : ctx.rx_events;
+	report(what, label, passes, (unsigned long long)pk->data_len * passes,
+	       events, elapsed);
+	printf("%-7s %-20s %10.2f deliveries/packet\n", what, label,
+	       (double)ctx.rx_calls / ((unsigned long long)pk->count * passes));
+}
+
+static void run_encode(int proto, const char *label, struct midi_stream *src,
+		       int n_ports)
+{
+	unsigned char out[128];
+	struct motu_codec codec;
+	struct bench_ctx ctx;
+	unsigned long passes = 0;
+	unsigned long long bytes = 0, events = 0, saved = 0, total = 0;
+	double start, elapsed;
+	int p, len, idle, drained;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.src = src;
+
+	start = now();
+	do {
+		bench_codec_init(&codec, n_ports, &ctx);
+		for (p = 0; p < n_ports; p++) {
+			src[p].pos = 0;
+			events += src[p].events;
+		}
+
+		/* stop once the sources are drained and nothing is queued */
+		idle = 0;
+		while (idle < 2) {
+			if (proto == 1)
+				len = motu_midi_encode_prot1(&codec, out,
+							     sizeof(out));
+			else
+				len = motu_midi_encode_prot2(&codec, out,
+							     PROT2_PACKET);
+			bytes += len;
+			/* a packet may come out empty before a source is */
+			for (p = 0, drained = 1; p < n_ports; p++)
+				if (src[p].pos < src[p].len)
+					drained = 0;
+			idle = len || !drained ? 0 : idle + 1;
+		}
+		for (p = 0; p < n_ports; p++) {
+			saved += codec.out_status[p].saved;
+			total += src[p].len;
+		}
+		passes++;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	report(proto == 1 ? "p1 enc" : "p2 enc", label, passes, bytes, events,
+	       elapsed);
+	printf("%-7s %-20s %10.2f%% of the bytes saved by running status\n",
+	       proto == 1 ? "p1 enc" : "p2 enc", label,
+	       total ? saved * 100.0 / total : 0.0);
+}
+
+/*
+ * Protocol 2 output with a dump on port 0 and light traffic on the other
+ * ports. Reports the longest run of packets in which a port had complete
+ * messages queued but got nothing sent, for the dump and for the other
+ * ports, and the port switches spent.
+ */
+static void run_fairness(int n_ports, size_t n_events, unsigned int seed)
+{
+	struct midi_stream src[MOTU_MAX_PORTS];
+	unsigned int p_out[MOTU_MAX_PORTS];
+	int waiting[MOTU_MAX_PORTS], wait[MOTU_MAX_PORTS] = {0};
+	unsigned char out[PROT2_PACKET];
+	unsigned long long bytes = 0, switches = 0, packets = 0;
+	struct motu_codec codec;
+	struct bench_ctx ctx;
+	int max_wait[2] = {0}; // dump, other ports
+	int p, i, len, idle, drained;
+
+	for (p = 0; p < n_ports; p++)
+		midi_stream_generate(&src[p], seed, p,
+				     p ? n_events / 8 : n_events,
+				     p ? 0 : GEN_DUMP);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.src = src;
+	bench_codec_init(&codec, n_ports, &ctx);
+
+	idle = 0;
+	while (idle < 2) {
+		for (p = 0; p < n_ports; p++) {
+			waiting[p] = codec.mfifo[p].buf_send_len != 0;
+			p_out[p] = codec.mfifo[p].p_out;
+		}
+
+		len = motu_midi_encode_prot2(&codec, out, sizeof(out));
+		bytes += len;
+		packets++;
+		for (i = 0; i < len; i++)
+			if (out[i] == 0xf5)
+				switches++;
+
+		for (p = 0; p < n_ports; p++) {
+			if (waiting[p] && codec.mfifo[p].p_out == p_out[p])
+				wait[p]++;
+			else
+				wait[p] = 0;
+			if (wait[p] > max_wait[p != 0])
+				max_wait[p != 0] = wait[p];
+		}
+
+		for (p = 0, drained = 1; p < n_ports; p++)
+			if (src[p].pos < src[p].len)
+				drained = 0;
+		idle = len || !drained ? 0 : idle + 1;
+	}
+
+	printf("%-7s %-20s %8llu packets %5.1f switches/kB, max wait "
+	       "%d/%d packets dump/others\n",
+	       "p2 enc", "dump on port 0", packets,
+	       bytes ? switches * 1000.0 / bytes : 0.0, max_wait[0],
+	       max_wait[1]);
+
+	for (p = 0; p < n_ports; p++)
+		midi_stream_free(&src[p]);
+}
+
+/*
+ * Edge cases of the codec with known results. A decode check feeds packets
+ * from the device and compares what each port received, an encode check
+ * writes the bytes of each port, decodes the packets the encoder made and
+ * expects the same bytes back.
+ */
+#define CHECK_PORTS 4
+
+struct check {
+	const char *name;
+	int proto;
+	const char *packets[4]; // from the device, NULL for an encode check
+	const char *ports[CHECK_PORTS]; // what each port receives or writes
+	const char *expect[CHECK_PORTS]; // comes back if not ports, encode
+	unsigned int buf_size; // ring or fifo of each port, 0 for the default
+	unsigned int dropped; // bytes the full ring has to drop
+	unsigned int filter; // input filter of every port
+	unsigned int filtered; // messages the filter has to drop on port 0
+	int resync; // motu_codec_resync() before this packet, 0 for none
+	const char *realtime; // queued on the lane of port 0, encode
+	int rt_packet; // before this packet
+};
+
+static const struct check checks[] = {
+	{ .name = "p1 running status", .proto = 1,
+	  .packets = { "00 00 01 90 01 10 01 7f 01 20 01 7f",
+		       "01 00 01 30 01 7f" },
+	  .ports = { "90 10 7f 90 20 7f 90 30 7f" } },
+	{ .name = "p1 two ports", .proto = 1,
+	  .packets = { "00 00 03 90 80 03 10 10 03 7f 00" },
+	  .ports = { "90 10 7f", "80 10 00" } },
+	{ .name = "p1 system common", .proto = 1,
+	  .packets = { "00 00 01 f1 01 10 01 f2 01 01 01 02 01 f6 01 c0 01 05"
+		       " 01 06" },
+	  .ports = { "f1 10 f2 01 02 f6 c0 05 c0 06" } },
+	{ .name = "p1 realtime in message", .proto = 1,
+	  .packets = { "00 00 01 90 01 10 01 f8 01 7f 01 20 01 7f" },
+	  .ports = { "f8 90 10 7f 90 20 7f" } },
+	{ .name = "p1 sysex", .proto = 1,
+	  .packets = { "00 00 04 f0 04 7e 04 7f 04 06",
+		       "01 00 04 01 04 f7 04 90 04 10 04 7f" },
+	  .ports = { NULL, NULL, "f0 7e 7f 06 01 f7 90 10 7f" } },
+	/* the sixth message no longer fits, the next packet finds room */
+	{ .name = "p1 full ring", .proto = 1,
+	  .packets = { "00 00 01 90 01 10 01 7f 01 90 01 11 01 7f 01 90 01 12"
+		       " 01 7f 01 90 01 13 01 7f 01 90 01 14 01 7f 01 90 01 15"
+		       " 01 7f",
+		       "01 00 01 90 01 16 01 7f" },
+	  .ports = { "90 10 7f 90 11 7f 90 12 7f 90 13 7f 90 14 7f 90 16 7f" },
+	  .buf_size = 16, .dropped = 2 },
+	/* channel 1 and clock, the running status note is dropped too */
+	{ .name = "p1 filter", .proto = 1,
+	  .packets = { "00 00 01 90 01 40 01 7f 01 f8 01 41 01 7f 01 fe 01 91"
+		       " 01 40 01 7f" },
+	  .ports = { "fe 91 40 7f" },
+	  .filter = 0x0001 | MOTU_FILTER_CLOCK, .filtered = 3 },
+	{ .name = "p1 filter aftertouch", .proto = 1,
+	  .packets = { "00 00 01 a0 01 40 01 10 01 d5 01 20 01 25 01 c5"
+		       " 01 01" },
+	  .ports = { "c5 01" },
+	  .filter = MOTU_FILTER_AFTERTOUCH, .filtered = 3 },
+	/* the half message before the resync is gone */
+	{ .name = "p1 resync", .proto = 1,
+	  .packets = { "00 00 01 90 01 10", "01 00 01 91 01 20 01 7f" },
+	  .ports = { "91 20 7f" }, .resync = 1 },
+	{ .name = "p2 port switch", .proto = 2,
+	  .packets = { "00 f5 00 90 10 7f f5 01 80 10 00 ff ff" },
+	  .ports = { "90 10 7f", "80 10 00" } },
+	{ .name = "p2 running status", .proto = 2,
+	  .packets = { "00 f5 03 b0 07 10 08 20", "01 09 30 ff ff" },
+	  .ports = { NULL, NULL, NULL, "b0 07 10 b0 08 20 b0 09 30" } },
+	{ .name = "p2 realtime in message", .proto = 2,
+	  .packets = { "00 f5 01 90 40 7f f8 41 7f 42 f8 7f f0 01 fe 02 f7" },
+	  .ports = { NULL,
+		     "90 40 7f f8 90 41 7f f8 90 42 7f f0 01 fe 02 f7" } },
+	{ .name = "p2 realtime after switch", .proto = 2,
+	  .packets = { "00 f5 02 f8 fa b0 07 10 f5 02 fc" },
+	  .ports = { NULL, NULL, "f8 fa b0 07 10 fc" } },
+	/* channel 1 filtered, the realtime in its note still gets through */
+	{ .name = "p2 realtime in filtered", .proto = 2,
+	  .packets = { "00 f5 00 90 40 fe 7f 91 40 7f" },
+	  .ports = { "fe 91 40 7f" }, .filter = 0x0001, .filtered = 1 },
+	{ .name = "p2 filter clock", .proto = 2,
+	  .packets = { "00 f5 00 90 40 f8 7f 41 7f f8 fe" },
+	  .ports = { "90 40 7f 90 41 7f fe" },
+	  .filter = MOTU_FILTER_CLOCK, .filtered = 2 },
+	{ .name = "p2 sysex across switch", .proto = 2,
+	  .packets = { "00 f5 00 f0 01 02 f5 01 90 10 7f f5 00 03 f7" },
+	  .ports = { "f0 01 02 03 f7", "90 10 7f" } },
+	/* after a resync nothing counts until the next port switch */
+	{ .name = "p2 resync", .proto = 2,
+	  .packets = { "00 f5 00 90 10", "01 7f 90 11 7f f5 01 91 20 7f" },
+	  .ports = { NULL, "91 20 7f" }, .resync = 1 },
+	{ .name = "p1 enc running status", .proto = 1,
+	  .ports = { "90 10 7f 90 20 7f f8 90 30 7f",
+		     "c0 05 c0 06 f2 01 02" } },
+	{ .name = "p1 enc sysex", .proto = 1,
+	  .ports = { "f0 7e 7f 06 01 00 01 02 03 04 05 06 07 08 09 f7 90 10 7f",
+		     "b0 07 10 b0 07 11" } },
+	/* the lane goes first, into the middle of the note */
+	{ .name = "p1 enc realtime lane", .proto = 1,
+	  .ports = { "c0 05 90 10 7f 80 10 00" },
+	  .expect = { "c0 05 f8 fa 90 10 7f 80 10 00" },
+	  .realtime = "f8 fa", .rt_packet = 1 },
+	{ .name = "p2 enc framing", .proto = 2,
+	  .ports = { "90 10 7f 80 10 00", "b0 07 10 b0 07 11", "c0 05 c0 06",
+		     "e0 00 40 90 20 7f" } },
+	{ .name = "p2 enc song position", .proto = 2,
+	  .ports = { "f2 00 01 f2 00 02 f2 00 03 f2 00 04 f2 00 05",
+		     "f2 10 01 f2 10 02 f2 10 03 f2 10 04 f2 10 05",
+		     "f3 01 f3 02 f3 03 f3 04 f3 05 f3 06",
+		     "f2 20 01 f1 10" } },
+	{ .name = "p2 enc long sysex", .proto = 2,
+	  .ports = { "f0 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11"
+		     " 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24"
+		     " 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37"
+		     " 38 39 3a 3b f7",
+		     "90 10 7f 90 11 7f" } },
+	/* the clock goes out with the second packet, inside the sysex */
+	{ .name = "p2 enc realtime lane", .proto = 2,
+	  .ports = { "f0 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11"
+		     " 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22 23 24"
+		     " 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34 35 36 37"
+		     " 38 39 3a 3b f7" },
+	  .expect = { "f0 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e f8 0f 10"
+		      " 11 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f 20 21 22"
+		      " 23 24 25 26 27 28 29 2a 2b 2c 2d 2e 2f 30 31 32 33 34"
+		      " 35 36 37 38 39 3a 3b f7" },
+	  .realtime = "f8", .rt_packet = 1 },
+	/* the sysex is longer than the fifo and goes out in pieces */
+	{ .name = "p2 enc full fifo", .proto = 2,
+	  .ports = { "f0 00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10 11"
+		     " 12 13 14 15 16 17 18 19 1a 1b 1c 1d 1e 1f f7 90 10 7f",
+		     "90 10 7f 90 11 7f 90 12 7f 90 13 7f 90 14 7f 90 15 7f" },
+	  .buf_size = 16 },
+};
+
+/*
+ * Times of USB packets rebuilt from the frame counter in byte 0: jitter of
+ * the completions is taken out, the counter wraps, a time ahead of the
+ * completion or too far behind it is pulled back, and a long gap starts
+ * over. In us, frame and completion time in, the time of the frame out.
+ */
+static const struct {
+	unsigned char frame;
+	unsigned int now;
+	unsigned int t;
+} clock_checks[] = {
+	{ 250, 1000000, 1000000 },
+	{ 251, 1001300, 1001000 },
+	{ 253, 1003100, 1003000 },
+	{ 1, 1007500, 1007000 }, // wrapped
+	{ 3, 1008200, 1008200 }, // can't be ahead of the completion
+	{ 4, 1020000, 1012000 }, // nor more than 8 frames behind
+	{ 5, 1300000, 1300000 }, // gap
+};
+
+static double budget_ns; // per packet, 0 for none
+
+static int parse_hex(const char *s, unsigned char *buf, int size)
+{
+	unsigned int b;
+	int n = 0, used;
+
+	while (s && n < size && sscanf(s, " %2x%n", &b, &used) == 1) {
+		buf[n++] = b;
+		s += used;
+	}
+	return n;
+}
+
+/* turn protocol 2 output into the input the decoder takes */
+static int prot2_output_to_input(const unsigned char *out, int len,
+				 unsigned char counter, struct motu_packets *pk)
+{
+	unsigned char buf[1 + PROT2_PACKET];
+	int i, n = 0;
+
+	if (len % 14)
+		return -1;
+
+	buf[n++] = counter;
+	for (i = 0; i < len; i += 14) {
+		if (out[i + 12] != 0x01 || out[i + 13] != 0x00)
+			return -1;
+		memcpy(buf + n, out + i, 12);
+		n += 12;
+	}
+	for (i = 1; i < n - 1; i++)
+		if (buf[i] == 0xf5 && buf[i + 1] != 0xff &&
+		    buf[i + 1] >= CHECK_PORTS)
+			return -1;
+
+	packets_add(pk, buf, n);
+	return 0;
+}
+
+/* encode the sources of ctx until they are drained, return the packets */
+static int check_encode(struct motu_codec *codec, const struct check *c,
+			struct midi_stream *src, struct motu_packets *pk)
+{
+	unsigned char out[PROT2_PACKET], rt[16];
+	int i, n, p, len, idle = 0, drained, packets = 0;
+	int proto = c->proto;
+
+	while (idle < 2) {
+		if (c->realtime && packets == c->rt_packet) {
+			n = parse_hex(c->realtime, rt, sizeof(rt));
+			for (i = 0; i < n; i++)
+				motu_codec_queue_realtime(codec, 0, rt[i]);
+		}
+		if (proto == 1)
+			len = motu_midi_encode_prot1(codec, out, sizeof(out));
+		else
+			len = motu_midi_encode_prot2(codec, out, sizeof(out));
+		if (len && pk) {
+			if (proto == 1)
+				packets_add(pk, out, len);
+			else if (prot2_output_to_input(out, len, packets,
+						       pk) < 0)
+				return -1;
+		}
+		packets++;
+		for (p = 0, drained = 1; p < CHECK_PORTS; p++)
+			if (src[p].pos < src[p].len)
+				drained = 0;
+		idle = len || !drained ? 0 : idle + 1;
+	}
+
+	return packets;
+}
+
+static void check_decode(struct motu_codec *codec, decode_fn decode,
+			 const struct motu_packets *pk, int resync)
+{
+	int i;
+
+	for (i = 0; i < pk->count; i++) {
+		if (resync && i == resync)
+			motu_codec_resync(codec);
+		decode(codec, pk->data + pk->off[i], pk->len[i]);
+	}
+}
+
+static int run_check(const struct check *c)
+{
+	struct midi_stream src[CHECK_PORTS], out[CHECK_PORTS];
+	unsigned char want[256];
+	struct motu_packets pk;
+	struct motu_codec codec;
+	struct bench_ctx ctx;
+	decode_fn decode = c->proto == 1 ? motu_midi_handle_input_prot1 :
+					   motu_midi_handle_input_prot2;
+	unsigned int saved_in = in_buf_size, saved_out = out_buf_size;
+	unsigned long long packets = 0;
+	double start, elapsed, ns;
+	int i, p, n, ret = 0;
+	const char *why = NULL;
+
+	memset(src, 0, sizeof(src));
+	memset(out, 0, sizeof(out));
+	memset(&ctx, 0, sizeof(ctx));
+	packets_init(&pk);
+
+	if (c->buf_size) {
+		if (c->packets[0])
+			in_buf_size = c->buf_size;
+		else
+			out_buf_size = c->buf_size;
+	}
+
+	if (c->packets[0]) {
+		for (i = 0; i < 4 && c->packets[i]; i++) {
+			n = parse_hex(c->packets[i], want, sizeof(want));
+			packets_add(&pk, want, n);
+		}
+	} else {
+		for (p = 0; p < CHECK_PORTS; p++) {
+			n = parse_hex(c->ports[p], want, sizeof(want));
+			src[p].data = malloc(n + 1);
+			memcpy(src[p].data, want, n);
+			src[p].len = n;
+		}
+		ctx.src = src;
+		bench_codec_init(&codec, CHECK_PORTS, &ctx);
+		if (check_encode(&codec, c, src, &pk) < 0)
+			why = "bad framing";
+	}
+
+	ctx.capture = out;
+	bench_codec_init(&codec, CHECK_PORTS, &ctx);
+	for (p = 0; p < CHECK_PORTS; p++)
+		codec.in_ports[p].filter = c->filter;
+	check_decode(&codec, decode, &pk, c->resync);
+
+	for (p = 0; p < CHECK_PORTS && !why; p++) {
+		n = parse_hex(c->expect[p] ? c->expect[p] : c->ports[p], want,
+			      sizeof(want));
+		if (out[p].len != (size_t)n ||
+		    memcmp(out[p].data, want, n) != 0)
+			why = "wrong bytes";
+		if (codec.in_ports[p].dropped != (p ? 0 : c->dropped))
+			why = "wrong drop count";
+		if (codec.in_ports[p].stats.filtered !=
+		    (p ? 0 : c->filtered))
+			why = "wrong filter count";
+		if (why)
+			printf("check   %-24s port %d: %s\n", c->name, p, why);
+	}
+
+	/* the same again without the capture, for the time */
+	ctx.capture = NULL;
+	start = now();
+	do {
+		for (i = 0; i < 1000; i++) {
+			if (c->packets[0]) {
+				check_decode(&codec, decode, &pk, c->resync);
+				packets += pk.count;
+				continue;
+			}
+			for (p = 0; p < CHECK_PORTS; p++)
+				src[p].pos = 0;
+			packets += check_encode(&codec, c, src, NULL);
+		}
+		elapsed = now() - start;
+	} while (elapsed < min_time / 10);
+	ns = packets ? elapsed * 1e9 / packets : 0.0;
+
+	if (!why && budget_ns && ns > budget_ns)
+		why = "over budget";
+	printf("check   %-24s %-11s %10.2f ns/packet\n", c->name,
+	       why ? why : "ok", ns);
+	ret = why != NULL;
+
+	for (p = 0; p < CHECK_PORTS; p++) {
+		midi_stream_free(&src[p]);
+		midi_stream_free(&out[p]);
+	}
+	packets_free(&pk);
+	in_buf_size = saved_in;
+	out_buf_size = saved_out;
+
+	return ret;
+}
+
+static int run_clock_check(void)
+{
+	struct motu_frame_clock clock;
+	unsigned long long updates = 0;
+	double start, elapsed, ns;
+	const char *why = NULL;
+	uint64_t t;
+	size_t i;
+	int k;
+
+	memset(&clock, 0, sizeof(clock));
+	for (i = 0; i < sizeof(clock_checks) / sizeof(clock_checks[0]); i++) {
+		t = motu_frame_clock_update(&clock, clock_checks[i].frame,
+					    clock_checks[i].now * 1000ULL);
+		if (t != clock_checks[i].t * 1000ULL && !why) {
+			printf("check   %-24s packet %zu: %llu ns\n",
+			       "frame clock", i, (unsigned long long)t);
+			why = "wrong time";
+		}
+	}
+
+	start = now();
+	do {
+		for (k = 0; k < 1000; k++)
+			for (i = 0; i < sizeof(clock_checks) /
+					    sizeof(clock_checks[0]); i++)
+				motu_frame_clock_update(
+					&clock, clock_checks[i].frame,
+					clock_checks[i].now * 1000ULL);
+		updates += 1000 * i;
+		elapsed = now() - start;
+	} while (elapsed < min_time / 10);
+	ns = elapsed * 1e9 / updates;
+
+	if (!why && budget_ns && ns > budget_ns)
+		why = "over budget";
+	printf("check   %-24s %-11s %10.2f ns/packet\n", "frame clock",
+	       why ? why : "ok", ns);
+
+	return why != NULL;
+}
+
+static int run_checks(void)
+{
+	int ret = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+		ret |= run_check(&checks[i]);
+	ret |= run_clock_check();
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-n events] [-s seed] [-p ports]\n"
+		"        [-b bytes] [-o bytes] [-r] [-c] [-B ns]\n"
+		"        [-1 prot1.hex] [-2 prot2.hex]\n"
+		"\n"
+		"  -t  minimum run time of each benchmark (default 1)\n"
+		"  -n  synthetic MIDI messages per port (default 20000)\n"
+		"  -s  seed for the synthetic traffic\n"
+		"  -p  number of ports (default 8)\n"
+		"  -b  input ring per port, a power of two (default %d)\n"
+		"  -o  output fifo per port, a power of two (default %d)\n"
+		"  -r  send every status byte, no running status on output\n"
+		"  -c  only run the edge case checks\n"
+		"  -B  fail a check that takes more than this per packet\n"
+		"  -1  captured protocol 1 input, one packet per line in hex\n"
+		"  -2  captured protocol 2 input, one packet per line in hex\n",
+		prog, MOTU_IN_BUF_SIZE, MOTU_OUT_BUF_SIZE);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct midi_stream src[MOTU_MAX_PORTS];
+	struct motu_packets pk;
+	const char *cap1 = NULL, *cap2 = NULL;
+	unsigned int seed = 1;
+	size_t n_events = 20000;
+	int n_ports = 8;
+	bool checks_only = false;
+	int opt, p, ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:n:s:p:b:o:rcB:1:2:h")) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'n':
+			n_events = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			n_ports = atoi(optarg);
+			if (n_ports < 1 || n_ports > 8)
+				usage(argv[0]);
+			break;
+		case 'b':
+			in_buf_size = strtoul(optarg, NULL, 0);
+			if (in_buf_size < 16 ||
+			    (in_buf_size & (in_buf_size - 1)) != 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			out_buf_size = strtoul(optarg, NULL, 0);
+			if (out_buf_size < 16 ||
+			    (out_buf_size & (out_buf_size - 1)) != 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			running_status = false;
+			break;
+		case 'c':
+			checks_only = true;
+			break;
+		case 'B':
+			budget_ns = atof(optarg);
+			break;
+		case '1':
+			cap1 = optarg;
+			break;
+		case '2':
+			cap2 = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	in_bufs = calloc(MOTU_MAX_PORTS, in_buf_size);
+	out_bufs = calloc(MOTU_MAX_PORTS, out_buf_size);
+	if (!in_bufs || !out_bufs)
+		return 1;
+
+	ret |= run_checks();
+	if (checks_only)
+		return ret;
+
+	/* the same streams, realtime and sysex included, for both protocols */
+	for (p = 0; p < n_ports; p++)
+		midi_stream_generate(&src[p], seed, p, n_events,
+				     GEN_REALTIME | GEN_SYSEX);
+
+	packets_init(&pk);
+	traffic_prot1(&pk, src, n_ports);
+	ret |= compare_decode("p1 dec", motu_midi_handle_input_prot1,
+			      decode_prot1_bitloop, &pk, n_ports);
+	run_decode("p1 dec", motu_midi_handle_input_prot1, "synthetic", &pk,
+		   n_ports);
+	run_decode("p1 ref", decode_prot1_bitloop, "synthetic bitloop", &pk,
+		   n_ports);
+	packets_free(&pk);
+	run_encode(1, "synthetic", src, n_ports);
+
+	packets_init(&pk);
+	traffic_prot2(&pk, src, n_ports);
+	ret |= compare_source("p2 dec", motu_midi_handle_input_prot2, &pk, src,
+			      n_ports);
+	run_decode("p2 dec", motu_midi_handle_input_prot2, "synthetic", &pk,
+		   n_ports);
+	packets_free(&pk);
+	run_encode(2, "synthetic", src, n_ports);
+	if (n_ports > 1)
+		run_fairness(n_ports, n_events, seed);
+
+	for (p = 0; p < n_ports; p++)
+		midi_stream_free(&src[p]);
+
+	if (cap1) {
+		packets_init(&pk);
+		if (packets_load_hex(&pk, cap1) == 0) {
+			ret |= compare_decode("p1 dec",
+					      motu_midi_handle_input_prot1,
+					      decode_prot1_bitloop, &pk, 8);
+			run_decode("p1 dec", motu_midi_handle_input_prot1, cap1,
+				   &pk, 8);
+			run_decode("p1 ref", decode_prot1_bitloop, cap1, &pk,
+				   8);
+		}
+		packets_free(&pk);
+	}
+
+	if (cap2) {
+		packets_init(&pk);
+		if (packets_load_hex(&pk, cap2) == 0)
+			run_decode("p2 dec", motu_midi_handle_input_prot2,
+				   cap2, &pk, MOTU_MAX_PORTS);
+		packets_free(&pk);
+	}
+
+	return ret;
+}
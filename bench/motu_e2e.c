@@ -0,0 +1,696 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   End to end benchmark for the MOTU driver
+ *
+ *   Opens the rawmidi substreams of a card in pairs, an output and the input
+ *   it is looped back to by a DIN cable or by emu/motu_emu -l, and drives
+ *   test patterns through all of them at once. Every message that comes
+ *   back is matched to the one sent, which gives throughput, latency
+ *   percentiles, jitter and loss per port.
+ *
+ *   This talks to the ALSA rawmidi and control devices in /dev/snd with the
+ *   ioctls of <sound/asound.h>, so it does not need alsa-lib.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sound/asound.h>
+
+#define MAX_PAIRS 16
+#define SYSEX_LEN 1024 // bytes of one message of the sysex pattern
+#define RESYNC_WINDOW 64 // sent messages searched for one that came back
+#define DRAIN_TIME 2.0 // seconds to wait for the last messages
+
+enum { PAT_NOTES, PAT_CC, PAT_CLOCK, PAT_SYSEX };
+
+struct pattern {
+	const char *name;
+	int kind;
+	double rate; // messages per second and port, 0 floods
+	bool running_status; // write without repeated status bytes
+};
+
+static const struct pattern patterns[] = {
+	{ "notes", PAT_NOTES, 0, false }, // note on/off flood
+	{ "cc", PAT_CC, 500, true }, // controller sweep, running status
+	{ "clock", PAT_CLOCK, 48, false }, // 24 ppqn at 120 bpm
+	{ "sysex", PAT_SYSEX, 0, false }, // SYSEX_LEN byte messages
+};
+
+#define N_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+/* a sent message, compared by length and hash when it comes back */
+struct sent_msg {
+	double t;
+	unsigned int len;
+	uint32_t hash;
+};
+
+struct pair {
+	int out, in; // substream numbers
+	int out_fd, in_fd;
+
+	/* sending */
+	unsigned long long seq;
+	unsigned char wbuf[SYSEX_LEN + 16];
+	unsigned int wlen, wpos;
+	unsigned char wstatus; // running status of what was written
+	struct sent_msg *sent; // ring of messages still to come back
+	unsigned int sent_cap, sent_head, sent_tail;
+	struct sent_msg pending; // the message in wbuf
+	double next_send;
+
+	/* receiving */
+	unsigned char status;
+	unsigned int need; // data bytes still missing
+	unsigned int len;
+	uint32_t hash;
+	bool sysex;
+
+	/* results */
+	unsigned long long sent_msgs, sent_bytes;
+	unsigned long long recv_msgs, recv_bytes;
+	unsigned long long lost_msgs, lost_bytes;
+	unsigned long long unexpected; // messages nobody sent
+	double *lat; // seconds
+	size_t n_lat, lat_cap;
+	double jitter_sum; // |difference| of consecutive latencies
+	double first_recv, last_recv;
+};
+
+static int card = -1;
+static int n_pairs;
+static struct pair pairs[MAX_PAIRS];
+static double run_time = 5.0;
+static double rate_override = -1;
+static const char *json_path;
+static FILE *json;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+static uint32_t hash_byte(uint32_t h, unsigned char b)
+{
+	return (h ^ b) * 16777619u; // FNV-1a
+}
+
+static uint32_t hash_buf(const unsigned char *buf, unsigned int len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = hash_byte(h, *buf++);
+	return h;
+}
+
+/* message seq of a pattern for one port, with its full status */
+static unsigned int pattern_msg(int kind, int port, unsigned long long seq,
+				unsigned char *buf)
+{
+	unsigned int i, n = seq / 2;
+
+	switch (kind) {
+	case PAT_NOTES:
+		buf[0] = (seq & 1 ? 0x80 : 0x90) | (port & 0x0f);
+		buf[1] = n & 0x7f;
+		buf[2] = seq & 1 ? 0 : 1 + (n >> 7) % 127;
+		return 3;
+	case PAT_CC:
+		buf[0] = 0xb0 | (port & 0x0f);
+		buf[1] = seq % 120;
+		buf[2] = (seq / 120) & 0x7f;
+		return 3;
+	case PAT_CLOCK:
+		buf[0] = 0xf8;
+		return 1;
+	default:
+		buf[0] = 0xf0;
+		buf[1] = 0x7d; // non-commercial
+		for (i = 2; i < SYSEX_LEN - 1; i++)
+			buf[i] = (seq + i) & 0x7f;
+		buf[SYSEX_LEN - 1] = 0xf7;
+		return SYSEX_LEN;
+	}
+}
+
+static void sent_push(struct pair *pr, const struct sent_msg *m)
+{
+	unsigned int i, n = pr->sent_head - pr->sent_tail;
+	struct sent_msg *ring;
+
+	if (n == pr->sent_cap) {
+		ring = xrealloc(NULL, (n ? n * 2 : 1024) * sizeof(*ring));
+		for (i = 0; i < n; i++)
+			ring[i] = pr->sent[(pr->sent_tail + i) % pr->sent_cap];
+		free(pr->sent);
+		pr->sent = ring;
+		pr->sent_cap = n ? n * 2 : 1024;
+		pr->sent_tail = 0;
+		pr->sent_head = n;
+	}
+	pr->sent[pr->sent_head++ % pr->sent_cap] = *m;
+}
+
+/* queue the next message of the pattern into the write buffer */
+static void next_msg(struct pair *pr, const struct pattern *pat)
+{
+	unsigned char msg[SYSEX_LEN];
+	unsigned int len;
+
+	len = pattern_msg(pat->kind, pr->out, pr->seq++, msg);
+	pr->pending.len = len;
+	pr->pending.hash = hash_buf(msg, len);
+
+	pr->wpos = 0;
+	if (pat->running_status && msg[0] == pr->wstatus) {
+		memcpy(pr->wbuf, msg + 1, len - 1);
+		pr->wlen = len - 1;
+	} else {
+		memcpy(pr->wbuf, msg, len);
+		pr->wlen = len;
+	}
+	if (msg[0] < 0xf0)
+		pr->wstatus = msg[0];
+	else if (msg[0] < 0xf8)
+		pr->wstatus = 0;
+}
+
+/* write what the driver takes, returns false once it takes no more */
+static bool send_some(struct pair *pr, const struct pattern *pat, double t)
+{
+	ssize_t n;
+
+	if (pr->wpos == pr->wlen) {
+		if (pat->rate > 0 && t < pr->next_send)
+			return false;
+		next_msg(pr, pat);
+		if (pat->rate > 0)
+			pr->next_send += 1.0 / pat->rate;
+	}
+
+	n = write(pr->out_fd, pr->wbuf + pr->wpos, pr->wlen - pr->wpos);
+	if (n < 0) {
+		if (errno != EAGAIN) {
+			perror("write");
+			exit(1);
+		}
+		return false;
+	}
+	pr->wpos += n;
+	pr->sent_bytes += n;
+	if (pr->wpos == pr->wlen) {
+		// sent once the driver has all of it
+		pr->pending.t = now();
+		sent_push(pr, &pr->pending);
+		pr->sent_msgs++;
+	}
+	return true;
+}
+
+static void add_latency(struct pair *pr, double lat)
+{
+	double d;
+
+	if (pr->n_lat == pr->lat_cap) {
+		pr->lat_cap = pr->lat_cap ? pr->lat_cap * 2 : 4096;
+		pr->lat = xrealloc(pr->lat, pr->lat_cap * sizeof(*pr->lat));
+	}
+	if (pr->n_lat) {
+		d = lat - pr->lat[pr->n_lat - 1];
+		pr->jitter_sum += d < 0 ? -d : d;
+	}
+	pr->lat[pr->n_lat++] = lat;
+}
+
+/*
+ * Match a message that came back with the oldest one sent. Messages sent
+ * before it that did not come back are lost, a message that matches none
+ * of the next RESYNC_WINDOW is unexpected.
+ */
+static void received(struct pair *pr, unsigned int len, uint32_t hash,
+		     double t)
+{
+	unsigned int i, n = pr->sent_head - pr->sent_tail;
+	struct sent_msg *m;
+
+	pr->recv_msgs++;
+	pr->recv_bytes += len;
+	if (!pr->first_recv)
+		pr->first_recv = t;
+	pr->last_recv = t;
+
+	for (i = 0; i < n && i < RESYNC_WINDOW; i++) {
+		m = &pr->sent[(pr->sent_tail + i) % pr->sent_cap];
+		if (m->len == len && m->hash == hash)
+			break;
+	}
+	if (i == n || i == RESYNC_WINDOW) {
+		pr->unexpected++;
+		return;
+	}
+	for (; i > 0; i--) {
+		m = &pr->sent[pr->sent_tail++ % pr->sent_cap];
+		pr->lost_msgs++;
+		pr->lost_bytes += m->len;
+	}
+	m = &pr->sent[pr->sent_tail++ % pr->sent_cap];
+	add_latency(pr, t - m->t);
+}
+
+static unsigned int msg_data_len(unsigned char status)
+{
+	switch (status & 0xf0) {
+	case 0xc0:
+	case 0xd0:
+		return 1;
+	case 0xf0:
+		return status == 0xf2 ? 2 : status == 0xf1 || status == 0xf3;
+	default:
+		return 2;
+	}
+}
+
+/* split what came back into messages, restoring the running status */
+static void parse(struct pair *pr, const unsigned char *buf, int len,
+		  double t)
+{
+	unsigned char b;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		b = buf[i];
+		if (b >= 0xf8) {
+			if (b != 0xfe) // active sensing is not ours
+				received(pr, 1, hash_byte(2166136261u, b), t);
+			continue;
+		}
+		if (b & 0x80) {
+			if (pr->sysex && b == 0xf7) {
+				pr->hash = hash_byte(pr->hash, b);
+				received(pr, pr->len + 1, pr->hash, t);
+				pr->sysex = false;
+				pr->status = 0;
+				continue;
+			}
+			pr->sysex = b == 0xf0;
+			pr->status = b < 0xf0 || pr->sysex ? b : 0;
+			pr->hash = hash_byte(2166136261u, b);
+			pr->len = 1;
+			pr->need = pr->sysex ? 0 : msg_data_len(b);
+			if (!pr->sysex && !pr->need)
+				received(pr, 1, pr->hash, t);
+			continue;
+		}
+		if (!pr->status)
+			continue; // data without a status
+		if (!pr->sysex && !pr->need) { // running status
+			pr->hash = hash_byte(2166136261u, pr->status);
+			pr->len = 1;
+			pr->need = msg_data_len(pr->status);
+		}
+		pr->hash = hash_byte(pr->hash, b);
+		pr->len++;
+		if (!pr->sysex && --pr->need == 0)
+			received(pr, pr->len, pr->hash, t);
+	}
+}
+
+static void receive_all(struct pair *pr)
+{
+	unsigned char buf[4096];
+	ssize_t n;
+
+	while ((n = read(pr->in_fd, buf, sizeof(buf))) > 0)
+		parse(pr, buf, n, now());
+	if (n < 0 && errno != EAGAIN) {
+		perror("read");
+		exit(1);
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct pair *pr, double p)
+{
+	size_t i;
+
+	if (!pr->n_lat)
+		return 0;
+	i = p * (pr->n_lat - 1) + 0.5;
+	return pr->lat[i];
+}
+
+static void report(const struct pattern *pat, struct pair *pr, double elapsed)
+{
+	double p50, p99, p999, jitter, bps;
+
+	qsort(pr->lat, pr->n_lat, sizeof(*pr->lat), cmp_double);
+	p50 = percentile(pr, 0.5) * 1e6;
+	p99 = percentile(pr, 0.99) * 1e6;
+	p999 = percentile(pr, 0.999) * 1e6;
+	jitter = pr->n_lat > 1 ? pr->jitter_sum / (pr->n_lat - 1) * 1e6 : 0;
+	bps = elapsed > 0 ? pr->recv_bytes / elapsed : 0;
+
+	printf("%-6s %2d>%-2d %9llu %9llu %7llu %10.0f %9.0f %9.0f %9.0f "
+	       "%8.0f\n",
+	       pat->name, pr->out, pr->in, pr->sent_msgs,
+	       pr->recv_msgs, pr->lost_bytes, bps, p50, p99, p999, jitter);
+
+	if (json)
+		fprintf(json,
+			"{\"pattern\":\"%s\",\"out\":%d,\"in\":%d,"
+			"\"sent_msgs\":%llu,\"sent_bytes\":%llu,"
+			"\"recv_msgs\":%llu,\"recv_bytes\":%llu,"
+			"\"lost_msgs\":%llu,\"lost_bytes\":%llu,"
+			"\"unexpected\":%llu,\"bytes_per_sec\":%.1f,"
+			"\"lat_p50_us\":%.1f,\"lat_p99_us\":%.1f,"
+			"\"lat_p999_us\":%.1f,\"jitter_us\":%.1f}\n",
+			pat->name, pr->out, pr->in, pr->sent_msgs,
+			pr->sent_bytes, pr->recv_msgs, pr->recv_bytes,
+			pr->lost_msgs, pr->lost_bytes, pr->unexpected, bps,
+			p50, p99, p999, jitter);
+}
+
+static void reset_pair(struct pair *pr)
+{
+	int out = pr->out, in = pr->in, out_fd = pr->out_fd;
+	int in_fd = pr->in_fd;
+
+	free(pr->sent);
+	free(pr->lat);
+	memset(pr, 0, sizeof(*pr));
+	pr->out = out;
+	pr->in = in;
+	pr->out_fd = out_fd;
+	pr->in_fd = in_fd;
+}
+
+static void run_pattern(const struct pattern *pat)
+{
+	struct pollfd pfd[2 * MAX_PAIRS];
+	struct pair *pr;
+	double start, end, t;
+	bool busy;
+	int i;
+
+	for (i = 0; i < n_pairs; i++) {
+		reset_pair(&pairs[i]);
+		receive_all(&pairs[i]); // leftovers of the pattern before
+		reset_pair(&pairs[i]);
+	}
+
+	start = now();
+	end = start + run_time;
+	for (i = 0; i < n_pairs; i++)
+		pairs[i].next_send = start;
+
+	for (t = start; t < end + DRAIN_TIME; t = now()) {
+		for (i = 0; i < n_pairs; i++) {
+			pr = &pairs[i];
+			busy = true;
+			while (t < end && busy)
+				busy = send_some(pr, pat, t);
+			// a message half written still has to go out
+			while (t >= end && pr->wpos < pr->wlen &&
+			       send_some(pr, pat, t))
+				;
+			receive_all(pr);
+
+			pfd[2 * i].fd = pr->out_fd;
+			pfd[2 * i].events = t < end ? POLLOUT : 0;
+			pfd[2 * i + 1].fd = pr->in_fd;
+			pfd[2 * i + 1].events = POLLIN;
+		}
+		if (t >= end) {
+			busy = false;
+			for (i = 0; i < n_pairs; i++)
+				busy |= pairs[i].sent_head !=
+					pairs[i].sent_tail;
+			if (!busy)
+				break;
+		}
+		// paced patterns wake up for their next message
+		poll(pfd, 2 * n_pairs, pat->rate > 0 ? 1 : 10);
+	}
+
+	for (i = 0; i < n_pairs; i++) {
+		pr = &pairs[i];
+		while (pr->sent_tail != pr->sent_head) {
+			pr->lost_msgs++;
+			pr->lost_bytes += pr->sent[pr->sent_tail++ %
+						   pr->sent_cap].len;
+		}
+		report(pat, pr,
+		       pr->last_recv > start ? pr->last_recv - start : 0);
+	}
+}
+
+static int find_card(void)
+{
+	struct snd_ctl_card_info info;
+	char path[32];
+	int c, fd;
+
+	for (c = 0; c < 32; c++) {
+		snprintf(path, sizeof(path), "/dev/snd/controlC%d", c);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		memset(&info, 0, sizeof(info));
+		if (!ioctl(fd, SNDRV_CTL_IOCTL_CARD_INFO, &info) &&
+		    !strcmp((char *)info.driver, "snd-motu")) {
+			close(fd);
+			return c;
+		}
+		close(fd);
+	}
+
+	return -1;
+}
+
+static int substream_count(int ctl, int stream)
+{
+	struct snd_rawmidi_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.device = 0;
+	info.stream = stream;
+	if (ioctl(ctl, SNDRV_CTL_IOCTL_RAWMIDI_INFO, &info) < 0)
+		return 0;
+	return info.subdevices_count;
+}
+
+/* open one substream, picked through the control device first */
+static int open_substream(int ctl, int sub, int mode)
+{
+	struct snd_rawmidi_params params;
+	char path[32];
+	int fd;
+
+	if (ioctl(ctl, SNDRV_CTL_IOCTL_RAWMIDI_PREFER_SUBDEVICE, &sub) < 0) {
+		perror("SNDRV_CTL_IOCTL_RAWMIDI_PREFER_SUBDEVICE");
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "/dev/snd/midiC%dD0", card);
+	fd = open(path, mode | O_NONBLOCK);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	// room for a whole run of the flood patterns coming back
+	if (mode == O_RDONLY) {
+		memset(&params, 0, sizeof(params));
+		params.stream = SNDRV_RAWMIDI_STREAM_INPUT;
+		params.buffer_size = 65536;
+		params.avail_min = 1;
+		ioctl(fd, SNDRV_RAWMIDI_IOCTL_PARAMS, &params);
+	}
+
+	return fd;
+}
+
+static void add_pair(int out, int in)
+{
+	if (n_pairs == MAX_PAIRS) {
+		fprintf(stderr, "too many pairs\n");
+		exit(1);
+	}
+	pairs[n_pairs].out = out;
+	pairs[n_pairs].in = in;
+	n_pairs++;
+}
+
+static void print_build(void)
+{
+	char srcversion[64] = "unknown";
+	struct utsname u;
+	FILE *f;
+
+	f = fopen("/sys/module/motu/srcversion", "r");
+	if (f) {
+		if (fscanf(f, "%63s", srcversion) != 1)
+			strcpy(srcversion, "unknown");
+		fclose(f);
+	}
+	uname(&u);
+
+	printf("card %d, kernel %s, module srcversion %s\n", card, u.release,
+	       srcversion);
+	if (json)
+		fprintf(json,
+			"{\"card\":%d,\"kernel\":\"%s\",\"srcversion\":\"%s\","
+			"\"run_time\":%.1f}\n",
+			card, u.release, srcversion, run_time);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-c card] [-P out:in,...] [-p patterns]\n"
+		"        [-t seconds] [-r rate] [-j results.json]\n"
+		"\n"
+		"  -c  card number (default the first snd-motu card)\n"
+		"  -P  output:input substream pairs that are looped back\n"
+		"      (default every output to the input of the same number)\n"
+		"  -p  patterns to run, out of notes,cc,clock,sysex (default\n"
+		"      all)\n"
+		"  -t  time each pattern sends for (default 5)\n"
+		"  -r  messages per second and port, 0 floods (default per\n"
+		"      pattern)\n"
+		"  -j  append the results to a file, one JSON object per\n"
+		"      line\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *pair_list = NULL, *pattern_list = NULL;
+	struct pattern pat;
+	char path[32], *s, *tok;
+	int opt, ctl, n_out, n_in, i, out, in;
+	unsigned int p;
+
+	while ((opt = getopt(argc, argv, "c:P:p:t:r:j:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			card = atoi(optarg);
+			break;
+		case 'P':
+			pair_list = optarg;
+			break;
+		case 'p':
+			pattern_list = optarg;
+			break;
+		case 't':
+			run_time = atof(optarg);
+			break;
+		case 'r':
+			rate_override = atof(optarg);
+			break;
+		case 'j':
+			json_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (card < 0)
+		card = find_card();
+	if (card < 0) {
+		fprintf(stderr, "no snd-motu card found\n");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "/dev/snd/controlC%d", card);
+	ctl = open(path, O_RDWR);
+	if (ctl < 0) {
+		perror(path);
+		return 1;
+	}
+	n_out = substream_count(ctl, SNDRV_RAWMIDI_STREAM_OUTPUT);
+	n_in = substream_count(ctl, SNDRV_RAWMIDI_STREAM_INPUT);
+
+	if (pair_list) {
+		s = strdup(pair_list);
+		for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+			if (sscanf(tok, "%d:%d", &out, &in) != 2 || out < 0 ||
+			    out >= n_out || in < 0 || in >= n_in)
+				usage(argv[0]);
+			add_pair(out, in);
+		}
+		free(s);
+	} else {
+		for (i = 0; i < n_out && i < n_in; i++)
+			add_pair(i, i);
+	}
+	if (!n_pairs) {
+		fprintf(stderr, "card %d has no rawmidi ports\n", card);
+		return 1;
+	}
+
+	for (i = 0; i < n_pairs; i++) {
+		pairs[i].out_fd = open_substream(ctl, pairs[i].out, O_WRONLY);
+		pairs[i].in_fd = open_substream(ctl, pairs[i].in, O_RDONLY);
+	}
+
+	if (json_path) {
+		json = fopen(json_path, "a");
+		if (!json) {
+			perror(json_path);
+			return 1;
+		}
+	}
+
+	print_build();
+	printf("%-6s %5s %9s %9s %7s %10s %9s %9s %9s %8s\n", "test", "port",
+	       "sent", "received", "lost_B", "B/s", "p50_us", "p99_us",
+	       "p99.9_us", "jitter");
+
+	for (p = 0; p < N_PATTERNS; p++) {
+		if (pattern_list && !strstr(pattern_list, patterns[p].name))
+			continue;
+		pat = patterns[p];
+		if (rate_override >= 0)
+			pat.rate = rate_override;
+		run_pattern(&pat);
+	}
+
+	if (json)
+		fclose(json);
+	return 0;
+}
@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Replay captured MOTU input through the protocol decoders
+ *
+ *   Reads a USB capture, pcap or pcapng from Wireshark or tcpdump on a
+ *   usbmon interface or from USBPcap, or the text of
+ *   /sys/kernel/debug/usb/usbmon/<bus>u, takes the payloads the device sent
+ *   on its interrupt endpoint 0x81 and runs them through
+ *   motu_midi_handle_input_prot1/prot2. Prints what each port received and
+ *   how long each packet took to decode.
+ */
+
+#include <ctype.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../motu_codec.h"
+#include "traffic.h"
+
+#define EP_IN 0x81
+#define MAX_FRAME 262144 // larger records are taken for a broken file
+
+/* link types of USB captures */
+#define LINKTYPE_USB_LINUX 189 // usbmon, 48 byte header
+#define LINKTYPE_USB_LINUX_MMAPPED 220 // usbmon, 64 byte header
+#define LINKTYPE_USBPCAP 249 // Windows
+
+struct replay_ctx {
+	FILE *out; // decoded streams, NULL while timing
+	int packet;
+	unsigned long long rx_bytes[MOTU_MAX_PORTS];
+};
+
+static int devnum = -1;
+static unsigned int in_buf_size = MOTU_IN_BUF_SIZE;
+static unsigned char *in_bufs;
+static unsigned char out_bufs[MOTU_MAX_PORTS * MOTU_OUT_BUF_SIZE];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hexval(char c)
+{
+	return isdigit((unsigned char)c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p, bool swap)
+{
+	if (swap)
+		return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* keep the payload of a frame if it is input from the device */
+static void add_frame(struct motu_packets *pk, int linktype,
+		      const unsigned char *buf, unsigned int len)
+{
+	unsigned int hdr, n;
+
+	switch (linktype) {
+	case LINKTYPE_USB_LINUX:
+	case LINKTYPE_USB_LINUX_MMAPPED:
+		hdr = linktype == LINKTYPE_USB_LINUX ? 48 : 64;
+		// completion of an interrupt URB on 0x81
+		if (len < hdr || buf[8] != 'C' || buf[9] != 1 ||
+		    buf[10] != EP_IN)
+			return;
+		if (devnum >= 0 && buf[11] != devnum)
+			return;
+		n = get32(buf + 36, false); // captured length
+		break;
+	case LINKTYPE_USBPCAP:
+		// info bit 0 set for what comes from the device
+		if (len < 27 || !(buf[16] & 1) || buf[22] != 1 ||
+		    buf[21] != EP_IN)
+			return;
+		if (devnum >= 0 && get16(buf + 19) != devnum)
+			return;
+		hdr = get16(buf);
+		n = get32(buf + 23, false);
+		break;
+	default:
+		return;
+	}
+
+	if (hdr > len)
+		return;
+	if (n > len - hdr)
+		n = len - hdr;
+	if (n > 0)
+		packets_add(pk, buf + hdr, n);
+}
+
+static int load_pcap(struct motu_packets *pk, FILE *f,
+		     const unsigned char *magic)
+{
+	unsigned char hdr[24], rec[16];
+	unsigned char *buf = NULL;
+	bool swap = magic[0] == 0xa1;
+	uint32_t len;
+	int linktype;
+
+	memcpy(hdr, magic, 4);
+	if (fread(hdr + 4, 1, 20, f) != 20)
+		return -1;
+	linktype = get32(hdr + 20, swap) & 0xffff;
+
+	while (fread(rec, 1, 16, f) == 16) {
+		len = get32(rec + 8, swap);
+		if (len > MAX_FRAME)
+			break;
+		buf = realloc(buf, len ? len : 1);
+		if (!buf || fread(buf, 1, len, f) != len)
+			break;
+		add_frame(pk, linktype, buf, len);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int load_pcapng(struct motu_packets *pk, FILE *f)
+{
+	int linktypes[64], linktype;
+	uint32_t n_if = 0;
+	unsigned char *buf = NULL;
+	unsigned char hdr[8];
+	uint32_t type, len, cap, id;
+
+	// the magic of the first block was read already
+	memcpy(hdr, "\x0a\x0d\x0d\x0a", 4);
+	if (fread(hdr + 4, 1, 4, f) != 4)
+		return -1;
+
+	for (;;) {
+		type = get32(hdr, false);
+		len = get32(hdr + 4, false);
+		if (len < 12 || len > MAX_FRAME)
+			break;
+		buf = realloc(buf, len - 8);
+		if (!buf || fread(buf, 1, len - 8, f) != len - 8)
+			break;
+
+		switch (type) {
+		case 0x0a0d0d0a: // section header, byte order magic first
+			if (buf[0] != 0x4d) {
+				fprintf(stderr,
+					"big endian pcapng is not supported\n");
+				free(buf);
+				return -1;
+			}
+			n_if = 0;
+			break;
+		case 1: // interface description
+			if (n_if < 64)
+				linktypes[n_if++] = get16(buf);
+			break;
+		case 6: // enhanced packet
+			if (len < 28)
+				break;
+			id = get32(buf, false);
+			cap = get32(buf + 12, false);
+			linktype = id < n_if ? linktypes[id] : -1;
+			if (cap <= len - 28)
+				add_frame(pk, linktype, buf + 20, cap);
+			break;
+		case 3: // simple packet, interface 0
+			if (len < 16 || !n_if)
+				break;
+			cap = get32(buf, false);
+			if (cap > len - 16)
+				cap = len - 16;
+			add_frame(pk, linktypes[0], buf + 4, cap);
+			break;
+		}
+
+		if (fread(hdr, 1, 8, f) != 8)
+			break;
+	}
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * usbmon text, one URB event per line:
+ *   ffff8d... 3575914555 C Ii:1:002:1 0:1 8 = 0100010c 0c
+ * Only the first 32 bytes of each URB are in the text.
+ */
+static int load_usbmon_text(struct motu_packets *pk, FILE *f)
+{
+	unsigned char buf[64];
+	char line[1024], addr[32], *p;
+	int bus, dev, ep;
+	unsigned int len;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*s %*s C %31s", addr) != 1)
+			continue;
+		// Ii:<bus>:<dev>:<ep>, older kernels leave out the bus
+		if (sscanf(addr, "Ii:%d:%d:%d", &bus, &dev, &ep) != 3 &&
+		    sscanf(addr, "Ii:%d:%d", &dev, &ep) != 2)
+			continue;
+		if (ep != (EP_IN & 0x0f))
+			continue;
+		if (devnum >= 0 && dev != devnum)
+			continue;
+		p = strstr(line, " = ");
+		if (!p)
+			continue;
+
+		len = 0;
+		for (p += 3; *p && len < sizeof(buf); p += 2) {
+			while (*p == ' ')
+				p++;
+			if (!isxdigit((unsigned char)p[0]) ||
+			    !isxdigit((unsigned char)p[1]))
+				break;
+			buf[len++] = hexval(p[0]) << 4 | hexval(p[1]);
+		}
+		if (len > 0)
+			packets_add(pk, buf, len);
+	}
+
+	return 0;
+}
+
+static int load_capture(struct motu_packets *pk, const char *path)
+{
+	unsigned char magic[4];
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(magic, 1, 4, f) == 4 &&
+	    (!memcmp(magic, "\xd4\xc3\xb2\xa1", 4) ||
+	     !memcmp(magic, "\xa1\xb2\xc3\xd4", 4) ||
+	     !memcmp(magic, "\x4d\x3c\xb2\xa1", 4) ||
+	     !memcmp(magic, "\xa1\xb2\x3c\x4d", 4))) {
+		ret = load_pcap(pk, f, magic);
+	} else if (!memcmp(magic, "\x0a\x0d\x0d\x0a", 4)) {
+		ret = load_pcapng(pk, f);
+	} else {
+		rewind(f);
+		ret = load_usbmon_text(pk, f);
+	}
+
+	fclose(f);
+	return ret;
+}
+
+static void replay_receive(struct motu_codec *codec, int port,
+			   const unsigned char *buf, int len)
+{
+	struct replay_ctx *ctx = codec->private_data;
+	int i;
+
+	ctx->rx_bytes[port] += len;
+	if (!ctx->out)
+		return;
+
+	fprintf(ctx->out, "%d %d:", ctx->packet, port);
+	for (i = 0; i < len; i++)
+		fprintf(ctx->out, " %02x", buf[i]);
+	fputc('\n', ctx->out);
+}
+
+static int replay_transmit(struct motu_codec *codec, int port,
+			   unsigned char *buf, int len)
+{
+	return 0;
+}
+
+static void replay_transmit_ack(struct motu_codec *codec, int port,
+				const unsigned char *buf, int len)
+{
+}
+
+static const struct motu_codec_ops replay_codec_ops = {
+	.receive = replay_receive,
+	.transmit = replay_transmit,
+	.transmit_ack = replay_transmit_ack,
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p 1|2] [-n ports] [-d devnum] [-r passes]\n"
+		"        [-o decoded.txt] [-w packets.hex] [-v] capture\n"
+		"\n"
+		"  -p  protocol of the device (default 1)\n"
+		"  -n  number of input ports (default 8, 9 for protocol 2)\n"
+		"  -d  USB device number, if the capture has several\n"
+		"  -r  timed passes over the capture (default 100)\n"
+		"  -o  write the decoded streams there instead of stdout\n"
+		"  -w  write the packets as hex, for motu_bench -1/-2\n"
+		"  -v  print the decode time of every packet\n"
+		"\n"
+		"The capture is pcap or pcapng of a usbmon or USBPcap\n"
+		"interface, or the text of /sys/kernel/debug/usb/usbmon.\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	void (*decode)(struct motu_codec *codec, const unsigned char *buf,
+		       unsigned int buf_len);
+	const char *out_path = NULL, *hex_path = NULL;
+	struct replay_ctx ctx = { 0 };
+	struct motu_codec codec;
+	struct motu_packets pk;
+	uint64_t *best, *sorted, t, total = 0;
+	int proto = 1, n_ports = 0, passes = 100, verbose = 0;
+	unsigned int j;
+	int opt, i, pass;
+	size_t bytes = 0;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "p:n:d:r:o:w:vh")) != -1) {
+		switch (opt) {
+		case 'p':
+			proto = atoi(optarg);
+			if (proto != 1 && proto != 2)
+				usage(argv[0]);
+			break;
+		case 'n':
+			n_ports = atoi(optarg);
+			if (n_ports < 1 || n_ports > MOTU_MAX_PORTS)
+				usage(argv[0]);
+			break;
+		case 'd':
+			devnum = atoi(optarg);
+			break;
+		case 'r':
+			passes = atoi(optarg);
+			if (passes < 1)
+				usage(argv[0]);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'w':
+			hex_path = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	if (!n_ports)
+		n_ports = proto == 1 ? 8 : 9;
+	// protocol 1 masks have 8 bits
+	if (proto == 1 && n_ports > 8)
+		usage(argv[0]);
+	decode = proto == 1 ? motu_midi_handle_input_prot1
+			    : motu_midi_handle_input_prot2;
+
+	packets_init(&pk);
+	if (load_capture(&pk, argv[optind]) < 0)
+		return 1;
+	if (!pk.count) {
+		fprintf(stderr, "%s: no input packets from endpoint 0x%02x\n",
+			argv[optind], EP_IN);
+		return 1;
+	}
+
+	if (hex_path) {
+		f = fopen(hex_path, "w");
+		if (!f) {
+			perror(hex_path);
+			return 1;
+		}
+		for (i = 0; i < pk.count; i++) {
+			for (j = 0; j < pk.len[i]; j++)
+				fprintf(f, "%s%02x", j ? " " : "",
+					pk.data[pk.off[i] + j]);
+			fputc('\n', f);
+		}
+		fclose(f);
+	}
+
+	in_bufs = calloc(MOTU_MAX_PORTS, in_buf_size);
+	best = calloc(pk.count, sizeof(*best));
+	sorted = calloc(pk.count, sizeof(*sorted));
+	if (!in_bufs || !best || !sorted)
+		return 1;
+
+	/* the first pass writes what was decoded, the others are timed */
+	ctx.out = stdout;
+	if (out_path) {
+		ctx.out = fopen(out_path, "w");
+		if (!ctx.out) {
+			perror(out_path);
+			return 1;
+		}
+	}
+	for (pass = 0; pass <= passes; pass++) {
+		motu_codec_init(&codec, n_ports, n_ports, in_bufs,
+				in_buf_size, out_bufs, MOTU_OUT_BUF_SIZE,
+				&replay_codec_ops, &ctx);
+		for (i = 0; i < pk.count; i++) {
+			ctx.packet = i;
+			t = now_ns();
+			decode(&codec, pk.data + pk.off[i], pk.len[i]);
+			motu_codec_flush_input(&codec);
+			t = now_ns() - t;
+			if (pass == 1 || (pass > 1 && t < best[i]))
+				best[i] = t;
+		}
+		if (ctx.out && ctx.out != stdout)
+			fclose(ctx.out);
+		ctx.out = NULL;
+	}
+
+	/* the fastest of the passes, which is the least disturbed one */
+	for (i = 0; i < pk.count; i++) {
+		total += best[i];
+		bytes += pk.len[i];
+		sorted[i] = best[i];
+		if (verbose)
+			printf("packet %d: %u bytes %llu ns\n", i, pk.len[i],
+			       (unsigned long long)best[i]);
+	}
+	qsort(sorted, pk.count, sizeof(*sorted), cmp_u64);
+
+	printf("%d packets, %zu bytes, protocol %d\n", pk.count, bytes, proto);
+	for (i = 0; i < n_ports; i++)
+		if (ctx.rx_bytes[i])
+			printf("port %d: %llu bytes\n", i,
+			       ctx.rx_bytes[i] / (passes + 1));
+	printf("decode ns/packet: avg %.1f p50 %llu p99 %llu max %llu\n",
+	       (double)total / pk.count,
+	       (unsigned long long)sorted[pk.count / 2],
+	       (unsigned long long)sorted[pk.count * 99 / 100],
+	       (unsigned long long)sorted[pk.count - 1]);
+	printf("decode MB/s: %.2f\n", total ? bytes * 1e3 / total : 0);
+
+	packets_free(&pk);
+	free(best);
+	free(sorted);
+	free(in_bufs);
+	return 0;
+}
@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Synthetic and captured MOTU traffic for the userspace tools
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../motu_codec.h"
+#include "traffic.h"
+
+#define PROT1_GROUPS 3	   // data bytes per port and USB frame
+#define PROT2_PAYLOAD 16 // bytes after the first one
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+void packets_init(struct motu_packets *pk)
+{
+	memset(pk, 0, sizeof(*pk));
+}
+
+void packets_free(struct motu_packets *pk)
+{
+	free(pk->data);
+	free(pk->off);
+	free(pk->len);
+	packets_init(pk);
+}
+
+void packets_add(struct motu_packets *pk, const unsigned char *buf,
+		 unsigned int len)
+{
+	if (pk->count == pk->cap) {
+		pk->cap = pk->cap ? pk->cap * 2 : 256;
+		pk->off = xrealloc(pk->off, pk->cap * sizeof(*pk->off));
+		pk->len = xrealloc(pk->len, pk->cap * sizeof(*pk->len));
+	}
+	if (pk->data_len + len > pk->data_cap) {
+		while (pk->data_len + len > pk->data_cap)
+			pk->data_cap = pk->data_cap ? pk->data_cap * 2 : 4096;
+		pk->data = xrealloc(pk->data, pk->data_cap);
+	}
+	memcpy(pk->data + pk->data_len, buf, len);
+	pk->off[pk->count] = pk->data_len;
+	pk->len[pk->count] = len;
+	pk->data_len += len;
+	pk->count++;
+}
+
+/*
+ * One packet per line, as hex bytes. Anything up to the last ':' is
+ * ignored so that "received from device:" debug dumps can be fed in.
+ */
+int packets_load_hex(struct motu_packets *pk, const char *path)
+{
+	unsigned char buf[1024];
+	char line[4096];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = strrchr(line, ':');
+		unsigned int len = 0;
+
+		if (line[0] == '#')
+			continue;
+		p = p ? p + 1 : line;
+		while (*p && len < sizeof(buf)) {
+			char *end;
+			unsigned long v;
+
+			while (*p && !isxdigit((unsigned char)*p))
+				p++;
+			if (!*p)
+				break;
+			v = strtoul(p, &end, 16);
+			if (end == p || v > 0xff)
+				break;
+			buf[len++] = v;
+			p = end;
+		}
+		if (len > 0)
+			packets_add(pk, buf, len);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static unsigned int xorshift(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void stream_put(struct midi_stream *ms, size_t *cap, unsigned char b)
+{
+	if (ms->len == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		ms->data = xrealloc(ms->data, *cap);
+	}
+	ms->data[ms->len++] = b;
+}
+
+/*
+ * Note and controller heavy traffic, mostly on the channel matching the
+ * port so that consecutive messages can share their status byte.
+ */
+void midi_stream_generate(struct midi_stream *ms, unsigned int seed, int port,
+			  size_t n_events, int flags)
+{
+	unsigned int rng = seed * 2654435761u + port + 1;
+	size_t cap = 0, n;
+	int chan, r, i, len;
+
+	memset(ms, 0, sizeof(*ms));
+
+	for (n = 0; n < n_events; n++) {
+		r = (flags & GEN_DUMP) ? 99 : xorshift(&rng) % 100;
+		chan = (xorshift(&rng) % 10) ? port & 0x0f
+					     : xorshift(&rng) & 0x0f;
+
+		if (r < 40) {
+			stream_put(ms, &cap, 0x90 | chan);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+		} else if (r < 65) {
+			stream_put(ms, &cap, 0xb0 | chan);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+		} else if (r < 72) {
+			stream_put(ms, &cap, 0xe0 | chan);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+		} else if (r < 77) {
+			stream_put(ms, &cap, 0xd0 | chan);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+		} else if (r < 80) {
+			stream_put(ms, &cap, 0xc0 | chan);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+		} else if (r < 92 && (flags & GEN_REALTIME)) {
+			stream_put(ms, &cap, 0xf8);
+		} else if (r < 95 && (flags & GEN_REALTIME)) {
+			stream_put(ms, &cap, 0xfe);
+		} else if (r >= 95 && (flags & (GEN_SYSEX | GEN_DUMP))) {
+			len = (flags & GEN_DUMP) ? 300
+						 : 4 + xorshift(&rng) % 20;
+			stream_put(ms, &cap, 0xf0);
+			stream_put(ms, &cap, 0x7d);
+			for (i = 0; i < len; i++)
+				stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+			stream_put(ms, &cap, 0xf7);
+		} else {
+			stream_put(ms, &cap, 0xb0 | chan);
+			stream_put(ms, &cap, 0x07);
+			stream_put(ms, &cap, xorshift(&rng) & 0x7f);
+		}
+		ms->events++;
+	}
+}
+
+void midi_stream_free(struct midi_stream *ms)
+{
+	free(ms->data);
+	memset(ms, 0, sizeof(*ms));
+}
+
+/* length of the message starting at data[pos] */
+static size_t msg_len(const unsigned char *data, size_t len, size_t pos)
+{
+	size_t end = pos + 1;
+	int n;
+
+	if (data[pos] == 0xf0) {
+		while (end < len && data[end] != 0xf7)
+			end++;
+		return end < len ? end + 1 - pos : len - pos;
+	}
+
+	n = motu_get_cmd_num_bytes(data[pos]);
+	if (n < 1)
+		n = 1;
+	return pos + n <= len ? (size_t)n : len - pos;
+}
+
+/*
+ * Strip repeated channel status bytes the way the device does. Any
+ * system message cancels the running status.
+ */
+static unsigned char *compress(const struct midi_stream *ms, size_t *out_len)
+{
+	unsigned char *out = xrealloc(NULL, ms->len ? ms->len : 1);
+	unsigned char status = 0;
+	size_t pos = 0, n = 0, len;
+
+	while (pos < ms->len) {
+		unsigned char b = ms->data[pos];
+
+		len = msg_len(ms->data, ms->len, pos);
+		if (b < 0xf0 && b == status) {
+			pos++;
+			len--;
+		} else {
+			status = b < 0xf0 ? b : 0;
+		}
+		memcpy(out + n, ms->data + pos, len);
+		n += len;
+		pos += len;
+	}
+
+	*out_len = n;
+	return out;
+}
+
+void traffic_prot1(struct motu_packets *pk, const struct midi_stream *ports,
+		   int n_ports)
+{
+	unsigned char *data[8];
+	size_t len[8], pos[8] = {0};
+	unsigned char pkt[2 + PROT1_GROUPS * 9];
+	unsigned char counter = 0;
+	int p, g, n, mask;
+
+	for (p = 0; p < n_ports; p++) {
+		data[p] = compress(&ports[p], &len[p]);
+		pk->events += ports[p].events;
+	}
+
+	for (;;) {
+		n = 0;
+		pkt[n++] = counter++;
+		pkt[n++] = 0;
+		for (g = 0; g < PROT1_GROUPS; g++) {
+			mask = 0;
+			for (p = 0; p < n_ports; p++)
+				if (pos[p] < len[p])
+					mask |= 1 << p;
+			if (!mask)
+				break;
+			pkt[n++] = mask;
+			for (p = 0; p < n_ports; p++)
+				if (mask & (1 << p))
+					pkt[n++] = data[p][pos[p]++];
+		}
+		if (n == 2)
+			break;
+		packets_add(pk, pkt, n);
+	}
+
+	for (p = 0; p < n_ports; p++)
+		free(data[p]);
+}
+
+void traffic_prot2(struct motu_packets *pk, const struct midi_stream *ports,
+		   int n_ports)
+{
+	unsigned char status[MOTU_MAX_PORTS] = {0};
+	size_t pos[MOTU_MAX_PORTS] = {0};
+	unsigned char *wire = NULL;
+	size_t wire_len = 0, wire_cap = 0, len, off;
+	unsigned char pkt[1 + PROT2_PAYLOAD];
+	unsigned char counter = 0;
+	int p, cur = -1, busy;
+
+	do {
+		busy = 0;
+		for (p = 0; p < n_ports; p++) {
+			const struct midi_stream *ms = &ports[p];
+			unsigned char b;
+
+			if (pos[p] >= ms->len)
+				continue;
+			busy = 1;
+			len = msg_len(ms->data, ms->len, pos[p]);
+			if (wire_len + len + 2 > wire_cap) {
+				wire_cap = wire_cap * 2 + len + 1024;
+				wire = xrealloc(wire, wire_cap);
+			}
+			/* the status is always repeated after a port switch */
+			if (p != cur) {
+				wire[wire_len++] = 0xf5;
+				wire[wire_len++] = p;
+				status[p] = 0;
+				cur = p;
+			}
+			b = ms->data[pos[p]];
+			if (b < 0xf0 && b == status[p]) {
+				pos[p]++;
+				len--;
+			} else {
+				status[p] = b;
+			}
+			memcpy(wire + wire_len, ms->data + pos[p], len);
+			wire_len += len;
+			pos[p] += len;
+		}
+	} while (busy);
+
+	for (p = 0; p < n_ports; p++)
+		pk->events += ports[p].events;
+
+	for (off = 0; off < wire_len; off += len) {
+		len = wire_len - off;
+		if (len > PROT2_PAYLOAD)
+			len = PROT2_PAYLOAD;
+		pkt[0] = counter++;
+		memcpy(pkt + 1, wire + off, len);
+		packets_add(pk, pkt, len + 1);
+	}
+
+	free(wire);
+}
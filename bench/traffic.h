@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   Synthetic and captured MOTU traffic for the userspace tools
+ */
+
+#ifndef MOTU_TRAFFIC_H
+#define MOTU_TRAFFIC_H
+
+#include <stddef.h>
+
+/* a list of USB packets as they travel on the wire */
+struct motu_packets {
+	unsigned char *data;
+	unsigned int *off;
+	unsigned int *len;
+	int count;
+	int cap;
+	size_t data_len;
+	size_t data_cap;
+	size_t events; // MIDI messages carried, 0 if unknown
+};
+
+void packets_init(struct motu_packets *pk);
+void packets_free(struct motu_packets *pk);
+void packets_add(struct motu_packets *pk, const unsigned char *buf,
+		 unsigned int len);
+int packets_load_hex(struct motu_packets *pk, const char *path);
+
+#define GEN_REALTIME 1 // clock and active sensing
+#define GEN_SYSEX 2
+#define GEN_DUMP 4 // nothing but long sysex, like a patch dump
+
+/* a plain MIDI byte stream for one port, status bytes always present */
+struct midi_stream {
+	unsigned char *data;
+	size_t len;
+	size_t pos;
+	size_t events;
+};
+
+void midi_stream_generate(struct midi_stream *ms, unsigned int seed, int port,
+			  size_t n_events, int flags);
+void midi_stream_free(struct midi_stream *ms);
+
+/* what the device sends to the host for the given per-port streams */
+void traffic_prot1(struct motu_packets *pk, const struct midi_stream *ports,
+		   int n_ports);
+void traffic_prot2(struct motu_packets *pk, const struct midi_stream *ports,
+		   int n_ports);
+
+#endif /* MOTU_TRAFFIC_H */
@@ -18,6 +18,7 @@ mkdir -p ${DEBSRCP} 2>/dev/null
 
 cp Makefile ${DEBSRCP}/
 cp *.c ${DEBSRCP}/
+cp *.h ${DEBSRCP}/
 cp dkms-deb.conf ${DEBSRCP}/dkms.conf
 
 cat >${DEBPATH}/DEBIAN/control << EOF
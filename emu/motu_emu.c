@@ -0,0 +1,689 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   MOTU midi express device emulator
+ *
+ *   Presents itself as one of the supported devices through the raw-gadget
+ *   interface of the kernel, normally on top of dummy_hcd, so that the real
+ *   snd-motu module binds to it on a machine without the hardware. What
+ *   the host sends on an output port can be looped back to the input port
+ *   of the same number, and synthetic traffic can be generated on all the
+ *   inputs for load tests.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <asm/byteorder.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "../motu_codec.h"
+#include "traffic.h"
+
+#define EMU_VID 0x07fd
+#define EMU_PID 0x0001
+#define EMU_MAX_PACKET 64
+#define EMU_IO_MAX 256
+#define EMU_LOOP_SIZE 4096 // loopback bytes per port, power of two
+#define EMU_PROT2_OUT (4 * 14) // one encoded packet, NUM_ISO frames
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum { STR_LANGID, STR_MANUFACTURER, STR_PRODUCT };
+
+struct emu_model {
+	const char *name;
+	const char *product; // what motu_probe() looks for in iProduct
+	unsigned char subclass;
+	int n_ports_in; // as seen by the host
+	int n_ports_out;
+	int proto;
+};
+
+/* port counts as the driver sets them up for each device */
+static const struct emu_model models[] = {
+	{ "128", "MIDI Express 128", 3, 8, 8, 1 },
+	{ "lite", "micro lite", 3, 5, 5, 1 },
+	{ "micro", "Micro Express", 1, 5, 7, 2 },
+	{ "xt", "MIDI Express XT", 1, 9, 9, 2 },
+};
+
+struct emu_control_event {
+	struct usb_raw_event inner;
+	struct usb_ctrlrequest ctrl;
+	unsigned char data[EMU_IO_MAX];
+};
+
+struct emu_io {
+	struct usb_raw_ep_io inner;
+	unsigned char data[EMU_IO_MAX];
+};
+
+struct emu_loop {
+	unsigned char buf[EMU_LOOP_SIZE];
+	unsigned int head, tail;
+};
+
+struct emu_stats {
+	unsigned long long out_packets; // host to device
+	unsigned long long out_errors;
+	unsigned long long out_bytes[MOTU_MAX_PORTS];
+	unsigned long long in_packets; // device to host
+	unsigned long long in_bytes;
+	unsigned long long loop_bytes;
+	unsigned long long loop_dropped;
+	unsigned long long gen_packets;
+	unsigned long long gen_events;
+};
+
+static const struct emu_model *model = &models[0];
+static const char *udc_driver = "dummy_udc";
+static const char *udc_device = "dummy_udc.0";
+static bool loopback;
+static bool gen_repeat;
+static double stats_interval;
+static int fd;
+static int ep_in = -1, ep_out = -1;
+static bool configured;
+static int alts[2]; // selected altsetting of each interface
+static volatile sig_atomic_t stop;
+
+/* everything below is under lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t in_ready = PTHREAD_COND_INITIALIZER;
+static struct motu_codec codec; // decodes host output, encodes loopback
+static unsigned char in_bufs[MOTU_MAX_PORTS * MOTU_IN_BUF_SIZE];
+static unsigned char out_bufs[MOTU_MAX_PORTS * MOTU_OUT_BUF_SIZE];
+static struct emu_loop loops[MOTU_MAX_PORTS];
+static struct motu_packets gen;
+static int gen_pos;
+static double gen_start, gen_end;
+static struct emu_stats stats;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* host output of one port, decoded, goes to the input of the same number */
+static void emu_receive(struct motu_codec *c, int port,
+			const unsigned char *buf, int len)
+{
+	struct emu_loop *l = &loops[port];
+	int i;
+
+	stats.out_bytes[port] += len;
+	if (!loopback)
+		return;
+	if (port >= model->n_ports_in) {
+		stats.loop_dropped += len;
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		if (l->head - l->tail >= EMU_LOOP_SIZE) {
+			stats.loop_dropped += len - i;
+			break;
+		}
+		l->buf[l->head++ & (EMU_LOOP_SIZE - 1)] = buf[i];
+	}
+	pthread_cond_signal(&in_ready);
+}
+
+static int emu_transmit(struct motu_codec *c, int port, unsigned char *buf,
+			int len)
+{
+	struct emu_loop *l = &loops[port];
+	int i;
+
+	if (len > l->head - l->tail)
+		len = l->head - l->tail;
+	for (i = 0; i < len; i++)
+		buf[i] = l->buf[(l->tail + i) & (EMU_LOOP_SIZE - 1)];
+	return len;
+}
+
+static void emu_transmit_ack(struct motu_codec *c, int port,
+			     const unsigned char *buf, int len)
+{
+	loops[port].tail += len;
+	stats.loop_bytes += len;
+}
+
+static const struct motu_codec_ops emu_codec_ops = {
+	.receive = emu_receive,
+	.transmit = emu_transmit,
+	.transmit_ack = emu_transmit_ack,
+};
+
+/*
+ * Turn what motu_midi_encode_prot2() made for the ISO endpoint into what the
+ * device sends on the interrupt endpoint: the 01 00 after every 12 bytes
+ * and the FF filler go, a counter byte comes first.
+ */
+static int emu_prot2_to_input(unsigned char *pkt, const unsigned char *out,
+			      int len)
+{
+	int i, n = 1;
+
+	for (i = 0; i < len; i++) {
+		if (i % 14 >= 12 || out[i] == 0xFF)
+			continue;
+		pkt[n++] = out[i];
+	}
+	return n;
+}
+
+/* the next packet for the host, loopback first, under lock */
+static int emu_next_in_packet(unsigned char *pkt)
+{
+	unsigned char out[EMU_PROT2_OUT];
+	int len = 0;
+
+	// the encoders also send what an earlier packet had no room for
+	if (model->proto == 1) {
+		len = motu_midi_encode_prot1(&codec, pkt, EMU_MAX_PACKET);
+	} else {
+		len = motu_midi_encode_prot2(&codec, out, sizeof(out));
+		if (len > 0)
+			len = emu_prot2_to_input(pkt, out, len);
+	}
+	if (len > 0)
+		return len;
+
+	if (gen_pos < gen.count) {
+		len = gen.len[gen_pos];
+		memcpy(pkt, gen.data + gen.off[gen_pos], len);
+		stats.gen_packets++;
+		if (!gen_start)
+			gen_start = now();
+		if (++gen_pos == gen.count) {
+			stats.gen_events += gen.events;
+			if (gen_repeat)
+				gen_pos = 0;
+			else
+				gen_end = now();
+		}
+	}
+
+	return len;
+}
+
+/*
+ * The device answers an interrupt IN poll only when it has something, so
+ * this waits for data. Byte 0 counts USB frames like the real one does.
+ */
+static void *emu_in_thread(void *arg)
+{
+	struct emu_io io;
+	double start = now();
+	int len, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!(len = emu_next_in_packet(io.data)))
+			pthread_cond_wait(&in_ready, &lock);
+		pthread_mutex_unlock(&lock);
+
+		io.data[0] = (unsigned long long)((now() - start) * 1000);
+		io.inner.ep = ep_in;
+		io.inner.flags = 0;
+		io.inner.length = len;
+		ret = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &io);
+		if (ret < 0)
+			die("ioctl(USB_RAW_IOCTL_EP_WRITE)");
+
+		pthread_mutex_lock(&lock);
+		stats.in_packets++;
+		stats.in_bytes += len;
+		pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
+
+static void emu_decode_prot2(const unsigned char *buf, int len)
+{
+	unsigned char pkt[1 + EMU_IO_MAX];
+
+	len = emu_prot2_to_input(pkt, buf, len);
+	motu_midi_handle_input_prot2(&codec, pkt, len);
+}
+
+/* host output, decoded with the input decoders of the driver */
+static void *emu_out_thread(void *arg)
+{
+	struct emu_io io;
+	int ret;
+
+	for (;;) {
+		io.inner.ep = ep_out;
+		io.inner.flags = 0;
+		io.inner.length = sizeof(io.data);
+		ret = ioctl(fd, USB_RAW_IOCTL_EP_READ, &io);
+
+		pthread_mutex_lock(&lock);
+		if (ret < 0) {
+			// dummy_hcd fails isochronous transfers outright
+			stats.out_errors++;
+			pthread_mutex_unlock(&lock);
+			usleep(1000);
+			continue;
+		}
+		stats.out_packets++;
+		if (model->proto == 1)
+			motu_midi_handle_input_prot1(&codec, io.data, ret);
+		else
+			emu_decode_prot2(io.data, ret);
+		motu_codec_flush_input(&codec);
+		pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
+
+static void print_stats(FILE *f)
+{
+	struct emu_stats s;
+	double start, end;
+	int p;
+
+	pthread_mutex_lock(&lock);
+	s = stats;
+	start = gen_start;
+	end = gen_end;
+	pthread_mutex_unlock(&lock);
+
+	fprintf(f, "to device: %llu packets, %llu failed\n", s.out_packets,
+		s.out_errors);
+	for (p = 0; p < model->n_ports_out; p++)
+		if (s.out_bytes[p])
+			fprintf(f, "  output %d: %llu bytes\n", p,
+				s.out_bytes[p]);
+	fprintf(f, "to host: %llu packets, %llu bytes\n", s.in_packets,
+		s.in_bytes);
+	fprintf(f, "  looped back: %llu bytes, %llu dropped\n", s.loop_bytes,
+		s.loop_dropped);
+	fprintf(f, "  generated: %llu packets\n", s.gen_packets);
+	if (end > start)
+		fprintf(f, "  generated traffic took %.3f s, %.0f events/s\n",
+			end - start, s.gen_events / (end - start));
+}
+
+static void *emu_stats_thread(void *arg)
+{
+	for (;;) {
+		usleep(stats_interval * 1e6);
+		print_stats(stdout);
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+/* bDeviceSubClass, 3 or 1, tells the driver which protocol to speak */
+static struct usb_device_descriptor device_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = __cpu_to_le16(0x0110),
+	.bDeviceClass = USB_CLASS_VENDOR_SPEC,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = __cpu_to_le16(EMU_VID),
+	.idProduct = __cpu_to_le16(EMU_PID),
+	.bcdDevice = __cpu_to_le16(0x0100),
+	.iManufacturer = STR_MANUFACTURER,
+	.iProduct = STR_PRODUCT,
+	.iSerialNumber = 0,
+	.bNumConfigurations = 1,
+};
+
+static struct usb_endpoint_descriptor ep_in_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = USB_DIR_IN | 1,
+	.bmAttributes = USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize = __cpu_to_le16(EMU_MAX_PACKET),
+	.bInterval = 1,
+};
+
+/* interrupt on protocol 1 devices, isochronous on protocol 2 ones */
+static struct usb_endpoint_descriptor ep_out_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = USB_DIR_OUT | 2,
+	.bmAttributes = USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize = __cpu_to_le16(EMU_MAX_PACKET),
+	.bInterval = 1,
+};
+
+static void put_iface(unsigned char **p, int num, int alt, int n_eps)
+{
+	struct usb_interface_descriptor d = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = num,
+		.bAlternateSetting = alt,
+		.bNumEndpoints = n_eps,
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+	};
+
+	memcpy(*p, &d, d.bLength);
+	*p += d.bLength;
+}
+
+/*
+ * Interface 0 is empty, interface 1 has the MIDI endpoints in altsetting
+ * 2, which motu_init_midi() selects.
+ */
+static int build_config(unsigned char *buf)
+{
+	struct usb_config_descriptor c = {
+		.bLength = USB_DT_CONFIG_SIZE,
+		.bDescriptorType = USB_DT_CONFIG,
+		.bNumInterfaces = 2,
+		.bConfigurationValue = 1,
+		.bmAttributes = USB_CONFIG_ATT_ONE,
+		.bMaxPower = 50,
+	};
+	unsigned char *p = buf + c.bLength;
+
+	put_iface(&p, 0, 0, 0);
+	put_iface(&p, 1, 0, 0);
+	put_iface(&p, 1, 1, 0);
+	put_iface(&p, 1, 2, 2);
+	memcpy(p, &ep_in_desc, USB_DT_ENDPOINT_SIZE);
+	p += USB_DT_ENDPOINT_SIZE;
+	memcpy(p, &ep_out_desc, USB_DT_ENDPOINT_SIZE);
+	p += USB_DT_ENDPOINT_SIZE;
+
+	c.wTotalLength = __cpu_to_le16(p - buf);
+	memcpy(buf, &c, c.bLength);
+	return p - buf;
+}
+
+static int build_string(unsigned char *buf, int index)
+{
+	const char *s;
+	int i;
+
+	if (index == STR_LANGID) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09; // en-US
+		buf[3] = 0x04;
+		return 4;
+	}
+	if (index == STR_MANUFACTURER)
+		s = "MOTU";
+	else if (index == STR_PRODUCT)
+		s = model->product;
+	else
+		return -1;
+
+	for (i = 0; s[i]; i++) {
+		buf[2 + 2 * i] = s[i];
+		buf[3 + 2 * i] = 0;
+	}
+	buf[0] = 2 + 2 * i;
+	buf[1] = USB_DT_STRING;
+	return buf[0];
+}
+
+static void start_io(void)
+{
+	pthread_t t;
+	int ret;
+
+	ep_in = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &ep_in_desc);
+	if (ep_in < 0)
+		die("ioctl(USB_RAW_IOCTL_EP_ENABLE) in");
+	ep_out = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &ep_out_desc);
+	if (ep_out < 0)
+		die("ioctl(USB_RAW_IOCTL_EP_ENABLE) out");
+
+	ret = pthread_create(&t, NULL, emu_in_thread, NULL);
+	if (!ret)
+		ret = pthread_create(&t, NULL, emu_out_thread, NULL);
+	if (ret) {
+		errno = ret;
+		die("pthread_create");
+	}
+}
+
+/* answer a control request on ep0, returns false to stall it */
+static bool handle_control(const struct usb_ctrlrequest *ctrl)
+{
+	struct emu_io io;
+	int len = -1, ret;
+
+	io.inner.ep = 0;
+	io.inner.flags = 0;
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (__le16_to_cpu(ctrl->wValue) >> 8) {
+		case USB_DT_DEVICE:
+			memcpy(io.data, &device_desc, sizeof(device_desc));
+			len = sizeof(device_desc);
+			break;
+		case USB_DT_CONFIG:
+			len = build_config(io.data);
+			break;
+		case USB_DT_STRING:
+			len = build_string(io.data,
+					   __le16_to_cpu(ctrl->wValue) & 0xff);
+			break;
+		}
+		break;
+	case USB_REQ_GET_STATUS:
+		io.data[0] = 0;
+		io.data[1] = 0;
+		len = 2;
+		break;
+	case USB_REQ_GET_CONFIGURATION:
+		io.data[0] = configured;
+		len = 1;
+		break;
+	case USB_REQ_GET_INTERFACE:
+		if (__le16_to_cpu(ctrl->wIndex) >= ARRAY_SIZE(alts))
+			break;
+		io.data[0] = alts[__le16_to_cpu(ctrl->wIndex)];
+		len = 1;
+		break;
+	case USB_REQ_SET_CONFIGURATION:
+		if (!configured) {
+			start_io();
+			ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, 100);
+			if (ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+				die("ioctl(USB_RAW_IOCTL_CONFIGURE)");
+			configured = true;
+		}
+		len = 0;
+		break;
+	case USB_REQ_SET_INTERFACE:
+		if (__le16_to_cpu(ctrl->wIndex) >= ARRAY_SIZE(alts))
+			break;
+		alts[__le16_to_cpu(ctrl->wIndex)] =
+			__le16_to_cpu(ctrl->wValue);
+		len = 0;
+		break;
+	}
+
+	if (len < 0)
+		return false;
+
+	if (ctrl->bRequestType & USB_DIR_IN) {
+		if (len > __le16_to_cpu(ctrl->wLength))
+			len = __le16_to_cpu(ctrl->wLength);
+		io.inner.length = len;
+		ret = ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+	} else {
+		io.inner.length = 0;
+		ret = ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io);
+	}
+	if (ret < 0)
+		perror("ep0 reply");
+
+	return true;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr,
+		"usage: %s [-m model] [-l] [-g events] [-k] [-s seed]\n"
+		"        [-i seconds] [-d driver] [-D device]\n"
+		"\n"
+		"  -m  device to emulate:",
+		prog);
+	for (i = 0; i < ARRAY_SIZE(models); i++)
+		fprintf(stderr, " %s", models[i].name);
+	fprintf(stderr,
+		" (default 128)\n"
+		"  -l  loop output port n back to input port n\n"
+		"  -g  generate that many MIDI messages on every input\n"
+		"  -k  keep generating, start over when done\n"
+		"  -s  seed for the generated traffic\n"
+		"  -i  print statistics every that many seconds\n"
+		"  -d  UDC driver (default dummy_udc)\n"
+		"  -D  UDC device (default dummy_udc.0)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct midi_stream src[MOTU_MAX_PORTS];
+	struct emu_control_event ev;
+	struct usb_raw_init init;
+	struct sigaction sa;
+	size_t n_events = 0;
+	unsigned int seed = 1;
+	pthread_t t;
+	int opt, i, ret;
+
+	while ((opt = getopt(argc, argv, "m:lg:ks:i:d:D:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (i = 0; i < ARRAY_SIZE(models); i++)
+				if (!strcmp(optarg, models[i].name))
+					break;
+			if (i == ARRAY_SIZE(models))
+				usage(argv[0]);
+			model = &models[i];
+			break;
+		case 'l':
+			loopback = true;
+			break;
+		case 'g':
+			n_events = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			gen_repeat = true;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			stats_interval = atof(optarg);
+			break;
+		case 'd':
+			udc_driver = optarg;
+			break;
+		case 'D':
+			udc_device = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	device_desc.bDeviceSubClass = model->subclass;
+	if (model->proto == 2)
+		ep_out_desc.bmAttributes = USB_ENDPOINT_XFER_ISOC;
+
+	/* the device side: decode what the driver sends, encode the inputs */
+	motu_codec_init(&codec, model->n_ports_out, model->n_ports_in, in_bufs,
+			MOTU_IN_BUF_SIZE, out_bufs, MOTU_OUT_BUF_SIZE,
+			&emu_codec_ops, NULL);
+
+	packets_init(&gen);
+	if (n_events) {
+		for (i = 0; i < model->n_ports_in; i++)
+			midi_stream_generate(&src[i], seed, i, n_events,
+					     GEN_REALTIME | GEN_SYSEX);
+		if (model->proto == 1)
+			traffic_prot1(&gen, src, model->n_ports_in);
+		else
+			traffic_prot2(&gen, src, model->n_ports_in);
+		for (i = 0; i < model->n_ports_in; i++)
+			midi_stream_free(&src[i]);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fd = open("/dev/raw-gadget", O_RDWR);
+	if (fd < 0)
+		die("open(/dev/raw-gadget)");
+
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, udc_driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, udc_device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_FULL;
+	if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0)
+		die("ioctl(USB_RAW_IOCTL_INIT)");
+	if (ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		die("ioctl(USB_RAW_IOCTL_RUN)");
+
+	if (stats_interval > 0)
+		pthread_create(&t, NULL, emu_stats_thread, NULL);
+
+	printf("emulating %s, protocol %d, %d inputs, %d outputs\n",
+	       model->product, model->proto, model->n_ports_in,
+	       model->n_ports_out);
+
+	while (!stop) {
+		ev.inner.type = 0;
+		ev.inner.length = sizeof(ev) - sizeof(ev.inner);
+		ret = ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &ev);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("ioctl(USB_RAW_IOCTL_EVENT_FETCH)");
+		}
+		// reset, disconnect and the like need no answer
+		if (ev.inner.type != USB_RAW_EVENT_CONTROL)
+			continue;
+		if (!handle_control(&ev.ctrl) &&
+		    ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+			perror("ioctl(USB_RAW_IOCTL_EP0_STALL)");
+	}
+
+	print_stats(stdout);
+	return 0;
+}
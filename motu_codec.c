@@ -0,0 +1,1038 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   MOTU midi express protocol encoders and decoders
+ *
+ *   Copyright (C) 2014 vampirefrog (motu-usb@vampi.tech)
+ *   touched 2022 lost-bit (lost-bit@tripod-systems.de)
+ *     support for micro express & micro lite added
+ */
+
+#include "motu_codec.h"
+
+void motu_codec_init(struct motu_codec *codec, int n_ports_in, int n_ports_out,
+		     unsigned char *in_bufs, unsigned int in_buf_size,
+		     unsigned char *out_bufs, unsigned int out_buf_size,
+		     const struct motu_codec_ops *ops, void *private_data)
+{
+	int p;
+
+	memset(codec, 0, sizeof(*codec));
+	for (p = 0; p < MOTU_MAX_PORTS; p++) {
+		codec->in_ports[p].buf = in_bufs + p * in_buf_size;
+		codec->in_ports[p].buf_size = in_buf_size;
+		codec->mfifo[p].mbuf = out_bufs + p * out_buf_size;
+		codec->mfifo[p].size = out_buf_size;
+	}
+	codec->ops = ops;
+	codec->private_data = private_data;
+	codec->n_ports_in = n_ports_in;
+	codec->n_ports_out = n_ports_out;
+	codec->last_out_port = -1;
+	codec->last_in_port = -1;
+	codec->in_state = 0;
+	codec->running_status = true;
+}
+
+/*
+ * Forget the parser and running status state after the device went away for
+ * a while, a suspend or a reset. Half parsed input is thrown away, bytes that
+ * are queued but not sent yet stay and go out with a full status.
+ */
+void motu_codec_resync(struct motu_codec *codec)
+{
+	struct motu_in_port *in;
+	int p;
+
+	for (p = 0; p < MOTU_MAX_PORTS; p++) {
+		in = &codec->in_ports[p];
+		in->head = in->send;
+		in->last_cmd = 0;
+		in->cmd_bytes_remaining = 0;
+		in->sysex = false;
+		in->skip = false;
+		in->cut = false;
+		codec->out_status[p].status = 0;
+		codec->out_status[p].remaining = 0;
+	}
+	codec->last_out_port = -1;
+	codec->last_in_port = -1;
+	codec->in_state = 0;
+	codec->clock.valid = false;
+}
+
+int motu_get_cmd_num_bytes(unsigned char b)
+{
+	static const int num_bytes[] = {
+		/* 8x */ 3,
+		/* 9x */ 3,
+		/* Ax */ 3,
+		/* Bx */ 3,
+		/* Cx */ 2,
+		/* Dx */ 2,
+		/* Ex */ 3,
+	};
+
+	static const int fx_bytes[] = {
+		/* F0 */ -1,
+		/* F1 */ 2,
+		/* F2 */ 3,
+		/* F3 */ 2,
+		/* F4 */ -1,
+		/* F5 */ -1,
+		/* F6 */ 1,
+		/* F7 */ 1,
+		/* F8 */ 1,
+		/* F9 */ 1,
+		/* FA */ 1,
+		/* FB */ 1,
+		/* FC */ 1,
+		/* FD */ -1,
+		/* FE */ 1,
+		/* FF */ 1,
+	};
+
+	if (b >= 0xf0)
+		return fx_bytes[b & 0x0f];
+
+	if (b >= 0x80)
+		return num_bytes[(b >> 4) - 8];
+
+	return -1;
+}
+
+/*
+ * Each input port stages its bytes in a ring indexed by free running
+ * counters: [tail, send) is complete and waits for userspace, [send, head)
+ * is the message still being parsed.
+ */
+static bool motu_in_port_put(struct motu_in_port *in_port, unsigned char b)
+{
+	if (in_port->head - in_port->tail >= in_port->buf_size) {
+		in_port->dropped++;
+		return false;
+	}
+
+	in_port->buf[in_port->head++ & (in_port->buf_size - 1)] = b;
+	return true;
+}
+
+/* forget the message that is still being parsed */
+static void motu_in_port_discard(struct motu_in_port *in_port)
+{
+	in_port->stats.cut += in_port->head - in_port->send;
+	in_port->head = in_port->send;
+}
+
+/*
+ * A message that does not fit in the ring is dropped as a whole, what was
+ * staged of it and the rest of its bytes.
+ */
+static void motu_in_port_append_byte(struct motu_codec *codec, int port,
+				     unsigned char b)
+{
+	struct motu_in_port *in_port = &codec->in_ports[port];
+
+	if (in_port->skip)
+		return;
+	if (in_port->cut) {
+		in_port->dropped++;
+		return;
+	}
+	if (!motu_in_port_put(in_port, b)) {
+		motu_in_port_discard(in_port);
+		in_port->cut = true;
+	}
+}
+
+/* mark everything staged so far as ready for userspace */
+static void motu_in_port_commit(struct motu_in_port *in_port)
+{
+	in_port->send = in_port->head;
+}
+
+/*
+ * Stage a realtime byte ahead of the message still being parsed, so that
+ * the message reaches userspace in one piece. Returns false if the ring is
+ * full, the byte is then dropped.
+ */
+static bool motu_in_port_put_realtime(struct motu_in_port *in_port,
+				      unsigned char b)
+{
+	unsigned int i, mask = in_port->buf_size - 1;
+
+	if (!motu_in_port_put(in_port, b))
+		return false;
+	for (i = in_port->head - 1; i != in_port->send; i--)
+		in_port->buf[i & mask] = in_port->buf[(i - 1) & mask];
+	in_port->buf[in_port->send++ & mask] = b;
+	in_port->stats.msgs++;
+	return true;
+}
+
+static unsigned int motu_in_port_pending(struct motu_in_port *in_port)
+{
+	return in_port->head - in_port->send;
+}
+
+/* the message with status b is dropped by the filter of the port */
+static bool motu_in_port_filtered(struct motu_in_port *in_port,
+				  unsigned char b)
+{
+	unsigned int filter = in_port->filter;
+	bool drop;
+
+	if (!filter)
+		return false;
+
+	switch (b) {
+	case 0xF8:
+		drop = filter & MOTU_FILTER_CLOCK;
+		break;
+	case 0xFE:
+		drop = filter & MOTU_FILTER_ACTIVE_SENSING;
+		break;
+	default:
+		if (b < 0x80 || b >= 0xF0)
+			drop = false;
+		else if (((b & 0xF0) == 0xA0 || (b & 0xF0) == 0xD0) &&
+			 (filter & MOTU_FILTER_AFTERTOUCH))
+			drop = true;
+		else
+			drop = filter & (1 << (b & 0x0F));
+		break;
+	}
+
+	// asked once per message, at its status or first data byte
+	if (drop)
+		in_port->stats.filtered++;
+	return drop;
+}
+
+void motu_in_port_write_byte(struct motu_codec *codec, int port,
+			     unsigned char b)
+{
+	int num_bytes;
+	struct motu_in_port *in_port;
+
+	in_port = &codec->in_ports[port];
+	codec->in_dirty |= 1 << port;
+
+	/* realtime is no status, the message it interrupts carries on */
+	if (b >= 0xF8) {
+		if (!motu_in_port_filtered(in_port, b))
+			motu_in_port_put_realtime(in_port, b);
+		return;
+	}
+
+	/* a sysex is handed on as it arrives, up to F7 or any other status */
+	if (b == 0xF0 ||
+	    (in_port->sysex && (b < 0x80 || b == 0xF7))) {
+		in_port->sysex = b != 0xF7;
+		in_port->skip = false;
+		in_port->cut = false;
+		in_port->last_cmd = 0;
+		in_port->cmd_bytes_remaining = 0;
+		if (b == 0xF0)
+			in_port->stats.msgs++;
+		motu_in_port_append_byte(codec, port, b);
+		motu_in_port_commit(in_port);
+		return;
+	}
+	in_port->sysex = false;
+
+	num_bytes = motu_get_cmd_num_bytes(b) - 1;
+	if (num_bytes == 0) {
+		if (motu_in_port_filtered(in_port, b))
+			return;
+		in_port->skip = false;
+		in_port->cut = false;
+		in_port->last_cmd = 0;
+		in_port->cmd_bytes_remaining = 0;
+		in_port->stats.msgs++;
+		motu_in_port_append_byte(codec, port, b);
+		motu_in_port_commit(in_port);
+	} else if (num_bytes > 0) {
+		in_port->last_cmd = b;
+		in_port->skip = motu_in_port_filtered(in_port, b);
+		in_port->cut = false;
+		in_port->cmd_bytes_remaining = num_bytes;
+		if (!in_port->skip)
+			in_port->stats.msgs++;
+		motu_in_port_commit(in_port);
+		motu_in_port_append_byte(codec, port, b);
+	} else if (in_port->last_cmd > 0) {
+		if (in_port->cmd_bytes_remaining <= 0) {
+			in_port->skip = motu_in_port_filtered(in_port,
+							      in_port->last_cmd);
+			in_port->cut = false;
+			motu_in_port_commit(in_port);
+			motu_in_port_append_byte(codec, port,
+						 in_port->last_cmd);
+			if (!in_port->skip) {
+				in_port->stats.msgs++;
+				in_port->stats.expanded++;
+			}
+			num_bytes = motu_get_cmd_num_bytes(in_port->last_cmd) -
+				    1;
+			in_port->cmd_bytes_remaining = num_bytes;
+		}
+		in_port->cmd_bytes_remaining--;
+		motu_in_port_append_byte(codec, port, b);
+		if (in_port->cmd_bytes_remaining == 0) {
+			motu_in_port_commit(in_port);
+		}
+	} else {
+		// in a normal stream, this shouldn't be reached
+		motu_in_port_append_byte(codec, port, b);
+		motu_in_port_commit(in_port);
+	}
+}
+
+/* hand the complete part of the ring to userspace, in at most two pieces */
+static void motu_in_port_flush(struct motu_codec *codec, int port)
+{
+	struct motu_in_port *in_port = &codec->in_ports[port];
+	unsigned int start = in_port->tail & (in_port->buf_size - 1);
+	unsigned int len = in_port->send - in_port->tail;
+	unsigned int first = in_port->buf_size - start;
+
+	if (len == 0)
+		return;
+
+	// the ring only fills between two flushes
+	if (in_port->head - in_port->tail > in_port->stats.peak)
+		in_port->stats.peak = in_port->head - in_port->tail;
+	in_port->stats.bytes += len;
+
+	if (first > len)
+		first = len;
+	codec->ops->receive(codec, port, in_port->buf + start, first);
+	if (len > first)
+		codec->ops->receive(codec, port, in_port->buf, len - first);
+
+	in_port->tail = in_port->send;
+}
+
+/*
+ * Hand everything that is complete over to userspace, once per port and
+ * packet, visiting only the ports that received data.
+ */
+void motu_codec_flush_input(struct motu_codec *codec)
+{
+	unsigned int dirty = codec->in_dirty;
+	int p;
+
+	codec->in_dirty = 0;
+	for (p = 0; dirty; p++, dirty >>= 1)
+		if (dirty & 1)
+			motu_in_port_flush(codec, p);
+}
+
+/*
+ * Byte 0 of a protocol 1 packet counts USB frames. The completion time of
+ * the URB carries the scheduling jitter of the host, so the time of a
+ * packet is the time of the previous one plus the frames in between, only
+ * pulled back into [now - MOTU_FRAME_SLACK_NS, now] when it leaves that
+ * window. This follows the earliest completions and stays monotonic.
+ */
+uint64_t motu_frame_clock_update(struct motu_frame_clock *clock,
+				 unsigned char frame, uint64_t now)
+{
+	uint64_t t;
+
+	// the counter wraps after 256 frames, start over after a long gap
+	if (!clock->valid || now - clock->tstamp > 200 * MOTU_FRAME_NS) {
+		t = now;
+	} else {
+		t = clock->tstamp +
+		    (unsigned char)(frame - clock->frame) * MOTU_FRAME_NS;
+		if (t > now)
+			t = now;
+		else if (now - t > MOTU_FRAME_SLACK_NS)
+			t = now - MOTU_FRAME_SLACK_NS;
+	}
+
+	clock->tstamp = t;
+	clock->frame = frame;
+	clock->valid = true;
+
+	return t;
+}
+
+/*
+ * Ports selected by each protocol 1 mask byte: the low nibble is the
+ * number of bits set, followed by the port numbers in ascending order,
+ * three bits each.
+ */
+static const uint32_t motu_mask_ports[256] = {
+	0x00000000, 0x00000001, 0x00000011, 0x00000082,
+	0x00000021, 0x00000102, 0x00000112, 0x00000883,
+	0x00000031, 0x00000182, 0x00000192, 0x00000c83,
+	0x000001a2, 0x00000d03, 0x00000d13, 0x00006884,
+	0x00000041, 0x00000202, 0x00000212, 0x00001083,
+	0x00000222, 0x00001103, 0x00001113, 0x00008884,
+	0x00000232, 0x00001183, 0x00001193, 0x00008c84,
+	0x000011a3, 0x00008d04, 0x00008d14, 0x00046885,
+	0x00000051, 0x00000282, 0x00000292, 0x00001483,
+	0x000002a2, 0x00001503, 0x00001513, 0x0000a884,
+	0x000002b2, 0x00001583, 0x00001593, 0x0000ac84,
+	0x000015a3, 0x0000ad04, 0x0000ad14, 0x00056885,
+	0x000002c2, 0x00001603, 0x00001613, 0x0000b084,
+	0x00001623, 0x0000b104, 0x0000b114, 0x00058885,
+	0x00001633, 0x0000b184, 0x0000b194, 0x00058c85,
+	0x0000b1a4, 0x00058d05, 0x00058d15, 0x002c6886,
+	0x00000061, 0x00000302, 0x00000312, 0x00001883,
+	0x00000322, 0x00001903, 0x00001913, 0x0000c884,
+	0x00000332, 0x00001983, 0x00001993, 0x0000cc84,
+	0x000019a3, 0x0000cd04, 0x0000cd14, 0x00066885,
+	0x00000342, 0x00001a03, 0x00001a13, 0x0000d084,
+	0x00001a23, 0x0000d104, 0x0000d114, 0x00068885,
+	0x00001a33, 0x0000d184, 0x0000d194, 0x00068c85,
+	0x0000d1a4, 0x00068d05, 0x00068d15, 0x00346886,
+	0x00000352, 0x00001a83, 0x00001a93, 0x0000d484,
+	0x00001aa3, 0x0000d504, 0x0000d514, 0x0006a885,
+	0x00001ab3, 0x0000d584, 0x0000d594, 0x0006ac85,
+	0x0000d5a4, 0x0006ad05, 0x0006ad15, 0x00356886,
+	0x00001ac3, 0x0000d604, 0x0000d614, 0x0006b085,
+	0x0000d624, 0x0006b105, 0x0006b115, 0x00358886,
+	0x0000d634, 0x0006b185, 0x0006b195, 0x00358c86,
+	0x0006b1a5, 0x00358d06, 0x00358d16, 0x01ac6887,
+	0x00000071, 0x00000382, 0x00000392, 0x00001c83,
+	0x000003a2, 0x00001d03, 0x00001d13, 0x0000e884,
+	0x000003b2, 0x00001d83, 0x00001d93, 0x0000ec84,
+	0x00001da3, 0x0000ed04, 0x0000ed14, 0x00076885,
+	0x000003c2, 0x00001e03, 0x00001e13, 0x0000f084,
+	0x00001e23, 0x0000f104, 0x0000f114, 0x00078885,
+	0x00001e33, 0x0000f184, 0x0000f194, 0x00078c85,
+	0x0000f1a4, 0x00078d05, 0x00078d15, 0x003c6886,
+	0x000003d2, 0x00001e83, 0x00001e93, 0x0000f484,
+	0x00001ea3, 0x0000f504, 0x0000f514, 0x0007a885,
+	0x00001eb3, 0x0000f584, 0x0000f594, 0x0007ac85,
+	0x0000f5a4, 0x0007ad05, 0x0007ad15, 0x003d6886,
+	0x00001ec3, 0x0000f604, 0x0000f614, 0x0007b085,
+	0x0000f624, 0x0007b105, 0x0007b115, 0x003d8886,
+	0x0000f634, 0x0007b185, 0x0007b195, 0x003d8c86,
+	0x0007b1a5, 0x003d8d06, 0x003d8d16, 0x01ec6887,
+	0x000003e2, 0x00001f03, 0x00001f13, 0x0000f884,
+	0x00001f23, 0x0000f904, 0x0000f914, 0x0007c885,
+	0x00001f33, 0x0000f984, 0x0000f994, 0x0007cc85,
+	0x0000f9a4, 0x0007cd05, 0x0007cd15, 0x003e6886,
+	0x00001f43, 0x0000fa04, 0x0000fa14, 0x0007d085,
+	0x0000fa24, 0x0007d105, 0x0007d115, 0x003e8886,
+	0x0000fa34, 0x0007d185, 0x0007d195, 0x003e8c86,
+	0x0007d1a5, 0x003e8d06, 0x003e8d16, 0x01f46887,
+	0x00001f53, 0x0000fa84, 0x0000fa94, 0x0007d485,
+	0x0000faa4, 0x0007d505, 0x0007d515, 0x003ea886,
+	0x0000fab4, 0x0007d585, 0x0007d595, 0x003eac86,
+	0x0007d5a5, 0x003ead06, 0x003ead16, 0x01f56887,
+	0x0000fac4, 0x0007d605, 0x0007d615, 0x003eb086,
+	0x0007d625, 0x003eb106, 0x003eb116, 0x01f58887,
+	0x0007d635, 0x003eb186, 0x003eb196, 0x01f58c87,
+	0x003eb1a6, 0x01f58d07, 0x01f58d17, 0x0fac6888,
+};
+
+void motu_midi_handle_input_prot1(struct motu_codec *codec,
+				  const unsigned char *buf,
+				  unsigned int buf_len)
+{
+	unsigned int i, j, n;
+	uint32_t ports;
+
+	if (buf_len < 2)
+		return;
+
+	/* mask byte, then one data byte for each port in the mask */
+	for (i = 2; i < buf_len; i += n) {
+		ports = motu_mask_ports[buf[i++]];
+		n = ports & 0x0f;
+		if (n > buf_len - i)
+			n = buf_len - i;
+		for (j = 0, ports >>= 4; j < n; j++, ports >>= 3)
+			motu_in_port_write_byte(codec, ports & 0x07,
+						buf[i + j]);
+	}
+
+	motu_codec_flush_input(codec);
+}
+
+void motu_midi_handle_input_prot2(struct motu_codec *codec,
+				  const unsigned char *buf,
+				  unsigned int buf_len)
+{
+	struct motu_in_port *in_port = NULL;
+	unsigned int i;
+	unsigned char cmd;
+	int n;
+
+	if (codec->last_in_port >= 0)
+		in_port = &codec->in_ports[codec->last_in_port];
+
+	// ignore 1st byte
+	i = 1;
+
+	while (i < buf_len) {
+		/*
+		 * Realtime may come anywhere once a port is selected, even
+		 * inside a message or a sysex. It is no status for running
+		 * status and no data byte, the message it interrupts carries
+		 * on after it.
+		 */
+		if (codec->in_state >= 2 && buf[i] >= 0xF8 && buf[i] != 0xFF) {
+			if (!motu_in_port_filtered(in_port, buf[i]) &&
+			    motu_in_port_put_realtime(in_port, buf[i]))
+				codec->in_dirty |= 1 << codec->last_in_port;
+			i++;
+			continue;
+		}
+
+		switch (codec->in_state) {
+		case 0:
+			if (buf[i] == 0xF5)
+				codec->in_state = 1;
+			break;
+		case 1: // desired port
+			if (buf[i] != 0xFF) {
+				// Validate port number to prevent buffer
+				// overflow
+				if (buf[i] >= codec->n_ports_in) {
+					motu_codec_warn(
+						"invalid port number %d (max "
+						"%d), resetting input state\n",
+						buf[i], codec->n_ports_in - 1);
+					codec->in_bad_port++;
+					codec->in_state = 0;
+					break;
+				}
+				codec->last_in_port = buf[i];
+				in_port = &codec->in_ports[codec->last_in_port];
+				motu_in_port_discard(in_port);
+				codec->in_state = 2;
+			}
+			break;
+		case 2: // data section
+			if (buf[i] == 0xF5) { // port switch, not a status
+				codec->in_state = 1;
+			} else if (in_port->last_cmd == 0xF0 &&
+				   ((buf[i] & 0x80) == 0 || buf[i] == 0xF7)) {
+				// a sysex carries on after a port switch
+				codec->in_state = 4;
+				continue;
+			} else if (buf[i] != 0xFF) {
+				cmd = buf[i] & 0x80 ? buf[i] : in_port->last_cmd;
+				if (motu_in_port_filtered(in_port, cmd)) {
+					// counted off in state 5, never staged
+					in_port->last_cmd = cmd;
+					n = motu_get_cmd_num_bytes(cmd) - 1;
+					if ((buf[i] & 0x80) == 0)
+						n--;
+					if (n > 0) {
+						in_port->cmd_bytes_remaining =
+							n;
+						codec->in_state = 5;
+					}
+					break;
+				}
+				if ((buf[i] & 0x80) == 0) {
+					if (!motu_in_port_put(in_port,
+							      in_port->last_cmd))
+						goto overflow;
+					in_port->stats.expanded++;
+				} else {
+					in_port->last_cmd = buf[i];
+				}
+				if (!motu_in_port_put(in_port, buf[i]))
+					goto overflow;
+				in_port->stats.msgs++;
+				codec->in_dirty |= 1 << codec->last_in_port;
+				switch (in_port->last_cmd) {
+				case 0xF0:
+					// sysex goes to userspace as it comes
+					motu_in_port_commit(in_port);
+					codec->in_state = 4;
+					break;
+				default:
+					n = motu_get_cmd_num_bytes(
+						in_port->last_cmd);
+					in_port->cmd_bytes_remaining =
+						n > 0 ? n : 1;
+					codec->in_state = 3;
+					// running status completes a two
+					// byte message right away
+					if (motu_in_port_pending(in_port) ==
+					    in_port->cmd_bytes_remaining) {
+						motu_in_port_commit(in_port);
+						codec->in_state = 2;
+					}
+					break;
+				}
+			}
+			break;
+		case 3:
+			if (buf[i] != 0xFF) {
+				if (!motu_in_port_put(in_port, buf[i]))
+					goto overflow;
+				if (motu_in_port_pending(in_port) ==
+				    in_port->cmd_bytes_remaining) {
+					motu_in_port_commit(in_port);
+					// the status may have come in an
+					// earlier, already flushed packet
+					codec->in_dirty |=
+						1 << codec->last_in_port;
+					codec->in_state = 2;
+				}
+			}
+			break;
+		case 4: // sysex
+			if (buf[i] == 0xF5) {
+				codec->in_state = 1;
+			} else if (buf[i] != 0xFF) {
+				if (!motu_in_port_put(in_port, buf[i]))
+					goto overflow;
+				motu_in_port_commit(in_port);
+				codec->in_dirty |= 1 << codec->last_in_port;
+				if (buf[i] == 0xF7) {
+					in_port->last_cmd = 0;
+					codec->in_state = 2;
+				}
+			}
+			break;
+		case 5: // filtered message
+			if (buf[i] != 0xFF &&
+			    --in_port->cmd_bytes_remaining == 0)
+				codec->in_state = 2;
+			break;
+		}
+		i++;
+		continue;
+
+overflow:
+		motu_codec_warn("input buffer overflow on port %d, dropping "
+				"data\n",
+				codec->last_in_port);
+		motu_in_port_discard(in_port);
+		codec->in_state = 0;
+		i++;
+	}
+
+	motu_codec_flush_input(codec);
+}
+
+/*
+ * Running status on output: a channel status byte that repeats the one
+ * of the previous complete message is left out. Sysex, the other system
+ * messages and realtime bytes cancel the status, in case the device does
+ * not keep it across them. Returns true if b is not to be sent.
+ */
+static bool motu_out_status_strip(struct motu_codec *codec, int port,
+				  unsigned char b)
+{
+	struct motu_out_status *s = &codec->out_status[port];
+	bool strip;
+	int n;
+
+	// every byte of the stream passes here, count its messages
+	if (b >= 0xF8) {
+		s->status = 0;
+		codec->out_stats[port].msgs++;
+		return false;
+	}
+	if (b >= 0xF0) {
+		s->status = 0;
+		s->remaining = 0;
+		if (b != 0xF7)
+			codec->out_stats[port].msgs++;
+		return false;
+	}
+	if (b & 0x80) {
+		codec->out_stats[port].msgs++;
+		// a message cut short keeps its status, the device resyncs
+		strip = codec->running_status && b == s->status &&
+			s->remaining == 0;
+		n = motu_get_cmd_num_bytes(b) - 1;
+		s->remaining = n > 0 ? n : 0;
+		s->status = b;
+		if (strip)
+			s->saved++;
+		return strip;
+	}
+
+	if (s->remaining)
+		s->remaining--;
+	else if (s->status) // running status from userspace
+		s->remaining = motu_get_cmd_num_bytes(s->status) - 2;
+	return false;
+}
+
+/*
+ * Queue a realtime byte on the priority lane of a port. It goes out in the
+ * next packet ahead of the queued data, even in the middle of a message.
+ */
+static bool motu_out_rt_put(struct motu_codec *codec, int port,
+			    unsigned char b)
+{
+	struct motu_out_rt *rt = &codec->out_rt[port];
+
+	if (rt->len >= MOTU_OUT_RT_SIZE)
+		return false;
+	rt->buf[rt->len++] = b;
+	return true;
+}
+
+bool motu_codec_queue_realtime(struct motu_codec *codec, int port,
+			       unsigned char b)
+{
+	if (!motu_out_rt_put(codec, port, b))
+		return false;
+	codec->out_stats[port].bytes++;
+	codec->out_stats[port].msgs++;
+	return true;
+}
+
+/* take up to len bytes off the priority lane of a port */
+static int motu_out_rt_take(struct motu_out_rt *rt, unsigned char *buf,
+			    int len)
+{
+	if (len > (int)rt->len)
+		len = rt->len;
+	memcpy(buf, rt->buf, len);
+	rt->len -= len;
+	memmove(rt->buf, rt->buf + len, rt->len);
+	return len;
+}
+
+/* fill the next packet for interrupt endpoint devices */
+int motu_midi_encode_prot1(struct motu_codec *codec, unsigned char *out,
+			   int size)
+{
+	int p, i, j, n, mask, bit;
+	int lens[8];
+	unsigned char bufs[8][3];
+	unsigned char in[6];
+	int outlen = 2;
+
+	out[0] = codec->counter++;
+	out[1] = 0;
+
+	/*
+	 * Realtime bytes take the first slots. A status byte left out takes
+	 * no slot, so look at more bytes of the stream than fit.
+	 */
+	for (p = 0; p < codec->n_ports_out; p++) {
+		lens[p] = motu_out_rt_take(&codec->out_rt[p], bufs[p], 3);
+		n = 0;
+		if (lens[p] < 3)
+			n = codec->ops->transmit(codec, p, in, sizeof(in));
+		for (j = 0; j < n && lens[p] < 3; j++)
+			if (!motu_out_status_strip(codec, p, in[j]))
+				bufs[p][lens[p]++] = in[j];
+		codec->ops->transmit_ack(codec, p, in, j);
+		codec->out_stats[p].bytes += j;
+	}
+
+	for (i = 0; i < 3; i++) {
+		mask = 0;
+		for (p = 0, bit = 1; p < codec->n_ports_out; p++, bit <<= 1) {
+			if (lens[p] > i)
+				mask |= bit;
+		}
+		if (mask == 0)
+			break;
+		if (outlen < size)
+			out[outlen++] = mask;
+		for (p = 0; p < codec->n_ports_out; p++) {
+			if (lens[p] > i && outlen < size)
+				out[outlen++] = bufs[p][i];
+		}
+	}
+
+	if (outlen <= 2)
+		return 0;
+	if (outlen < size)
+		out[outlen++] = 0;
+	if (outlen < size)
+		out[outlen++] = 0;
+
+	return outlen;
+}
+
+/* queue bytes for a protocol 2 port, returns how many fit */
+int motu_mfifo_in(struct motu_codec *codec, int port, unsigned char *buf,
+		  int len)
+{
+	struct motufifo *f = &codec->mfifo[port];
+	int i, n;
+
+	for (i = 0; i < len; i++) {
+		if (f->buf_len >= f->size)
+			break;
+		if (motu_out_status_strip(codec, port, buf[i]))
+			continue;
+		// realtime skips the queue when there is room on its lane
+		if (buf[i] >= 0xF8 && motu_out_rt_put(codec, port, buf[i]))
+			continue;
+
+		f->mbuf[f->p_in] = buf[i];
+		f->p_in++;
+		if (f->p_in >= f->size)
+			f->p_in = 0;
+
+		f->buf_len++;
+		if (buf[i] >= 0xF8) { // realtime, not inside another message
+			if (f->sysex || f->remaining == 0)
+				f->buf_send_len = f->buf_len;
+		} else if (buf[i] & 0x80) { // command
+			f->sysex = buf[i] == 0xF0;
+			switch (buf[i]) {
+			case 0xF0: // sysex command
+			case 0xF7: // end sysex
+				f->cmd_len = 0;
+				f->remaining = 0;
+				f->buf_send_len = f->buf_len;
+				break;
+			default:
+				n = motu_get_cmd_num_bytes(buf[i]) - 1;
+				f->cmd_len = n > 0 ? n : 0;
+				f->remaining = f->cmd_len;
+				if (f->cmd_len == 0)
+					f->buf_send_len = f->buf_len;
+				break;
+			}
+		} else if (f->sysex) {
+			// sysex streams out as it arrives
+			f->buf_send_len = f->buf_len;
+		} else if (f->cmd_len) {
+			if (f->remaining == 0)
+				f->remaining = f->cmd_len;
+			f->remaining--;
+			if (f->remaining == 0)
+				f->buf_send_len = f->buf_len;
+		}
+	}
+
+	return i;
+}
+
+/* a packet being filled with 12 byte frames, each followed by 01 00 */
+struct motu_prot2_frame {
+	unsigned char *out;
+	int size;
+	int i; // bytes in out
+	int k; // payload bytes in the current frame
+};
+
+static void motu_prot2_put(struct motu_prot2_frame *o, unsigned char b)
+{
+	o->out[o->i++] = b;
+	if (++o->k == 12) {
+		o->out[o->i++] = 1;
+		o->out[o->i++] = 0;
+		o->k = 0;
+	}
+}
+
+/* payload bytes that still fit, counting the current frame */
+static int motu_prot2_room(const struct motu_prot2_frame *o)
+{
+	return (o->size - o->i + o->k) / 14 * 12 - o->k;
+}
+
+/* the head of the fifo is sysex, which may be cut anywhere */
+static bool motu_mfifo_in_sysex(const struct motufifo *f)
+{
+	unsigned char b = f->mbuf[f->p_out];
+
+	return b == 0xF0 || (f->out_sysex && (b & 0x80) == 0);
+}
+
+/*
+ * Length of the message at the head of the fifo. A sysex goes out in
+ * pieces as it arrives, up to its F7 or the end of what is queued.
+ */
+static int motu_mfifo_msg_len(const struct motufifo *f)
+{
+	unsigned char b = f->mbuf[f->p_out];
+	int send_len = f->buf_send_len;
+	int len;
+
+	if (motu_mfifo_in_sysex(f)) {
+		for (len = 1; len < send_len; len++)
+			if (f->mbuf[(f->p_out + len) & (f->size - 1)] == 0xF7)
+				return len + 1;
+		return send_len;
+	}
+
+	if (b & 0x80)
+		len = motu_get_cmd_num_bytes(b);
+	else // running status
+		len = motu_get_cmd_num_bytes(f->last_cmd) - 1;
+	if (len < 1)
+		len = 1;
+
+	return len < send_len ? len : send_len;
+}
+
+/* bytes needed to send len bytes of port p, port switch included */
+static int motu_prot2_cost(struct motu_codec *codec,
+			   const struct motu_prot2_frame *o, int p, int len)
+{
+	const struct motufifo *f = &codec->mfifo[p];
+
+	if (p == codec->last_out_port)
+		return len;
+	// F5 <port> and a repeated status stay in one frame
+	if (o->k >= 10)
+		len += 12 - o->k;
+	len += 2;
+	if ((f->mbuf[f->p_out] & 0x80) == 0 && !f->out_sysex)
+		len++;
+
+	return len;
+}
+
+static void motu_prot2_send(struct motu_codec *codec,
+			    struct motu_prot2_frame *o, int p, int len)
+{
+	struct motufifo *f = &codec->mfifo[p];
+	unsigned char b;
+
+	if (p != codec->last_out_port) {
+		while (o->k >= 10)
+			motu_prot2_put(o, 0xFF);
+		motu_prot2_put(o, 0xF5);
+		motu_prot2_put(o, p);
+		codec->last_out_port = p;
+		codec->out_stats[p].switches++;
+		// a sysex just carries on after the switch
+		if ((f->mbuf[f->p_out] & 0x80) == 0 && !f->out_sysex)
+			motu_prot2_put(o, f->last_cmd);
+	}
+
+	while (len--) {
+		b = f->mbuf[f->p_out];
+		if ((b & 0x80) && b < 0xF8) {
+			f->last_cmd = b;
+			f->out_sysex = b == 0xF0;
+		}
+		motu_prot2_put(o, b);
+		f->p_out++;
+		if (f->p_out >= f->size)
+			f->p_out = 0;
+		f->buf_len--;
+		f->buf_send_len--;
+	}
+}
+
+/*
+ * Fill the next packet for isochronous endpoint devices: 12 byte frames,
+ * each followed by 01 00, with F5 <port> selecting the output port.
+ *
+ * Ports take turns in a deficit round robin over whole messages: each turn
+ * adds MOTU_OUT_QUANTUM bytes to the deficit of a port, which then sends
+ * messages for as long as they fit. A sysex is cut into pieces of what the
+ * deficit and the packet allow. No port waits for more than one round
+ * however much the others have queued, and a port switch is only spent on
+ * a port that sends something. The round carries over to the next packet.
+ */
+int motu_midi_encode_prot2(struct motu_codec *codec, unsigned char *out,
+			   int size)
+{
+	struct motu_prot2_frame o = { .out = out, .size = size };
+	struct motufifo *f;
+	struct motu_out_rt *rt;
+	int p, i, len, cost, empty;
+	bool sysex, switched = false;
+	unsigned char buf[16];
+
+	/*
+	 * Only take from userspace what fits, the rest stays in the rawmidi
+	 * buffer and throttles the writer.
+	 */
+	for (p = 0; p < codec->n_ports_out; p++) {
+		f = &codec->mfifo[p];
+		len = f->size - f->buf_len;
+		if (len > (int)sizeof(buf))
+			len = sizeof(buf);
+		len = codec->ops->transmit(codec, p, buf, len);
+		if (len > 0) {
+			len = motu_mfifo_in(codec, p, buf, len);
+			codec->ops->transmit_ack(codec, p, buf, len);
+			codec->out_stats[p].bytes += len;
+			if (f->buf_len > codec->out_stats[p].peak)
+				codec->out_stats[p].peak = f->buf_len;
+		}
+	}
+
+	/* the realtime lanes go first, wherever the streams of the ports are */
+	for (p = 0; p < codec->n_ports_out; p++) {
+		rt = &codec->out_rt[p];
+		if (!rt->len)
+			continue;
+		cost = 0;
+		if (p != codec->last_out_port)
+			cost = 2 + (o.k >= 10 ? 12 - o.k : 0);
+		len = motu_prot2_room(&o) - cost;
+		if (len <= 0)
+			break;
+		if (p != codec->last_out_port) {
+			while (o.k >= 10)
+				motu_prot2_put(&o, 0xFF);
+			motu_prot2_put(&o, 0xF5);
+			motu_prot2_put(&o, p);
+			codec->last_out_port = p;
+			codec->out_stats[p].switches++;
+			switched = true;
+		}
+		len = motu_out_rt_take(rt, buf, len);
+		for (i = 0; i < len; i++)
+			motu_prot2_put(&o, buf[i]);
+	}
+	// the stream of the port selected last may rely on another status
+	if (switched)
+		codec->last_out_port = -1;
+
+	if (codec->out_rr >= codec->n_ports_out)
+		codec->out_rr = 0;
+
+	for (empty = 0; empty < codec->n_ports_out;
+	     codec->out_rr = (codec->out_rr + 1) % codec->n_ports_out) {
+		p = codec->out_rr;
+		f = &codec->mfifo[p];
+		if (!f->buf_send_len) {
+			f->deficit = 0;
+			empty++;
+			continue;
+		}
+		empty = 0;
+
+		f->deficit += MOTU_OUT_QUANTUM;
+		while (f->buf_send_len) {
+			len = motu_mfifo_msg_len(f);
+			sysex = motu_mfifo_in_sysex(f);
+			if (sysex && len > f->deficit)
+				len = f->deficit;
+			if (len > f->deficit || len == 0)
+				break;
+			cost = motu_prot2_cost(codec, &o, p, len);
+			if (cost > motu_prot2_room(&o)) {
+				/* a sysex fills the packet, the rest waits */
+				len -= cost - motu_prot2_room(&o);
+				if (sysex && len > 0) {
+					motu_prot2_send(codec, &o, p, len);
+					f->deficit -= len;
+				}
+				goto send_buffer;
+			}
+			motu_prot2_send(codec, &o, p, len);
+			f->deficit -= len;
+		}
+		if (!f->buf_send_len)
+			f->deficit = 0;
+	}
+
+send_buffer:
+	// fill rest
+	while (o.k)
+		motu_prot2_put(&o, 0xFF);
+
+	return o.i;
+}
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   MOTU midi express protocol encoders and decoders
+ *
+ *   This file has no kernel dependencies, it is built both into the
+ *   module and into the userspace tools in bench/.
+ *
+ *   Copyright (C) 2014 vampirefrog (motu-usb@vampi.tech)
+ */
+
+#ifndef MOTU_CODEC_H
+#define MOTU_CODEC_H
+
+#ifdef __KERNEL__
+#include <linux/printk.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#define motu_codec_warn(fmt, ...)                                              \
+	pr_warn_ratelimited("snd-motu: " fmt, ##__VA_ARGS__)
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#define motu_codec_warn(fmt, ...)                                              \
+	do {                                                                   \
+	} while (0)
+#endif
+
+#define MOTU_MAX_PORTS 9
+#define MOTU_IN_BUF_SIZE 256 // default, must be a power of two
+#define MOTU_OUT_BUF_SIZE 256 // default, must be a power of two
+
+/* input filter of a port, what it drops is never staged */
+#define MOTU_FILTER_CHANNELS 0xffff // bit n drops MIDI channel n + 1
+#define MOTU_FILTER_CLOCK (1 << 16)
+#define MOTU_FILTER_ACTIVE_SENSING (1 << 17)
+#define MOTU_FILTER_AFTERTOUCH (1 << 18) // poly and channel pressure
+#define MOTU_FILTER_ALL 0x7ffff
+
+/* counters of an input port, kept by the decoders */
+struct motu_in_stats {
+	uint64_t bytes; // handed to userspace
+	uint64_t msgs; // status bytes staged, running status ones included
+	unsigned int expanded; // running status bytes put back
+	unsigned int filtered; // messages dropped by the filter
+	unsigned int cut; // bytes of messages cut short by a switch or overflow
+	unsigned int peak; // most bytes staged in the ring at once
+};
+
+struct motu_in_port {
+	unsigned char last_cmd;
+	unsigned char cmd_bytes_remaining;
+	bool sysex; // protocol 1, inside a sysex
+	bool skip; // the message being parsed is filtered
+	bool cut; // protocol 1, the message did not fit and is dropped
+	unsigned int filter;
+	unsigned char *buf;
+	unsigned int buf_size;
+	unsigned int head; // next byte to be parsed into the ring
+	unsigned int send; // end of the bytes that can be sent
+	unsigned int tail; // next byte for userspace
+	unsigned int dropped; // bytes that found the ring full
+	struct motu_in_stats stats;
+};
+
+/* USB frames are 1 ms on the full speed bus */
+#define MOTU_FRAME_NS 1000000ULL
+/* how far the rebuilt time may lag the URB completion */
+#define MOTU_FRAME_SLACK_NS (8 * MOTU_FRAME_NS)
+
+struct motu_frame_clock {
+	uint64_t tstamp; // time of the last frame seen, ns
+	unsigned char frame;
+	bool valid;
+};
+
+/* protocol 2 output round robin, bytes a port may send per turn */
+#define MOTU_OUT_QUANTUM 12
+
+struct motufifo {
+	unsigned char *mbuf;
+	unsigned int size;
+	unsigned int p_in, p_out;
+	unsigned char last_cmd;
+	unsigned int rd_bytes;
+	unsigned int missing_bytes;
+	unsigned int buf_len;
+	unsigned int buf_send_len;
+	unsigned int cmd_len;
+	unsigned int remaining;
+	int deficit; // bytes the port may still send in this round
+	bool sysex; // a sysex is being queued
+	bool out_sysex; // a sysex is being sent, no status may be repeated
+};
+
+/* running status compression of an output port */
+struct motu_out_status {
+	unsigned char status; // channel status the device has, 0 if none
+	unsigned char remaining; // data bytes missing from the message
+	unsigned int saved; // status bytes left out
+};
+
+/* counters of an output port, kept by the encoders */
+struct motu_out_stats {
+	uint64_t bytes; // taken from the stream and the realtime lane
+	uint64_t msgs; // status bytes among them
+	unsigned int switches; // protocol 2 port switches to the port
+	unsigned int peak; // most bytes in the protocol 2 fifo at once
+};
+
+/* realtime bytes of an output port, sent ahead of everything else */
+#define MOTU_OUT_RT_SIZE 16
+
+struct motu_out_rt {
+	unsigned char buf[MOTU_OUT_RT_SIZE];
+	unsigned int len;
+};
+
+struct motu_codec;
+
+struct motu_codec_ops {
+	/* hand decoded bytes of an input port over to userspace */
+	void (*receive)(struct motu_codec *codec, int port,
+			const unsigned char *buf, int len);
+	/* look at up to len bytes userspace wants to send on an output port */
+	int (*transmit)(struct motu_codec *codec, int port, unsigned char *buf,
+			int len);
+	/* the first len bytes of the last transmit were queued, take them */
+	void (*transmit_ack)(struct motu_codec *codec, int port,
+			     const unsigned char *buf, int len);
+};
+
+struct motu_codec {
+	const struct motu_codec_ops *ops;
+	void *private_data;
+
+	int n_ports_in;
+	int n_ports_out;
+
+	struct motu_in_port in_ports[MOTU_MAX_PORTS];
+	struct motufifo mfifo[MOTU_MAX_PORTS];
+	struct motu_out_status out_status[MOTU_MAX_PORTS];
+	struct motu_out_rt out_rt[MOTU_MAX_PORTS];
+	struct motu_out_stats out_stats[MOTU_MAX_PORTS];
+	bool running_status; // leave out repeated status bytes on output
+	unsigned char counter;
+
+	int last_out_port;
+	int out_rr; // next port of the protocol 2 output round robin
+	int last_in_port;
+	int in_state;
+	unsigned int in_dirty; // input ports with bytes staged since the flush
+	uint64_t in_tstamp; // time of the packet being decoded, ns
+	unsigned int in_bad_port; // protocol 2 switches to a missing port
+	struct motu_frame_clock clock;
+};
+
+/*
+ * in_bufs holds MOTU_MAX_PORTS rings of in_buf_size bytes each, out_bufs
+ * the same for the protocol 2 output fifos
+ */
+void motu_codec_init(struct motu_codec *codec, int n_ports_in, int n_ports_out,
+		     unsigned char *in_bufs, unsigned int in_buf_size,
+		     unsigned char *out_bufs, unsigned int out_buf_size,
+		     const struct motu_codec_ops *ops, void *private_data);
+void motu_codec_resync(struct motu_codec *codec);
+int motu_get_cmd_num_bytes(unsigned char b);
+
+/* decoders for packets received from the device */
+void motu_in_port_write_byte(struct motu_codec *codec, int port,
+			     unsigned char b);
+void motu_midi_handle_input_prot1(struct motu_codec *codec,
+				  const unsigned char *buf,
+				  unsigned int buf_len);
+void motu_midi_handle_input_prot2(struct motu_codec *codec,
+				  const unsigned char *buf,
+				  unsigned int buf_len);
+void motu_codec_flush_input(struct motu_codec *codec);
+uint64_t motu_frame_clock_update(struct motu_frame_clock *clock,
+				 unsigned char frame, uint64_t now);
+
+/* encoders for packets sent to the device, return the packet length */
+int motu_mfifo_in(struct motu_codec *codec, int port, unsigned char *buf,
+		  int len);
+bool motu_codec_queue_realtime(struct motu_codec *codec, int port,
+			       unsigned char b);
+int motu_midi_encode_prot1(struct motu_codec *codec, unsigned char *out,
+			   int size);
+int motu_midi_encode_prot2(struct motu_codec *codec, unsigned char *out,
+			   int size);
+
+#endif /* MOTU_CODEC_H */
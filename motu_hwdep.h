@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ *   Userspace interface of the MOTU midi hwdep device, /dev/snd/hwC<n>D0
+ *
+ *   Copyright (C) 2014 vampirefrog (motu-usb@vampi.tech)
+ */
+
+#ifndef MOTU_HWDEP_H
+#define MOTU_HWDEP_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MOTU_HWDEP_ID "MOTU MIDI"
+
+#define MOTU_HWDEP_EVENT_DATA 16
+
+/* the time comes from the frame counter of the device, not the host */
+#define MOTU_HWDEP_EVENT_FRAME_CLOCK 0x01
+/* records were lost before this one because nobody read them in time */
+#define MOTU_HWDEP_EVENT_OVERRUN 0x02
+
+/*
+ * read() returns whole records of received MIDI bytes. Bytes that arrived
+ * on the same port in the same USB frame share a record, longer runs are
+ * split over several records with the same time.
+ *
+ * write() takes records with one or more complete messages in data and
+ * their deadline in tstamp, for scheduled output.
+ */
+struct motu_hwdep_event {
+	__u64 tstamp; // CLOCK_MONOTONIC in ns
+	__u8 port;
+	__u8 len; // valid bytes in data
+	__u8 flags;
+	__u8 reserved[5];
+	__u8 data[MOTU_HWDEP_EVENT_DATA];
+};
+
+/*
+ * MOTU_HWDEP_IOCTL_MULTICAST sends the messages in data on every output
+ * port set in ports, between the messages of their rawmidi streams. The
+ * copies go out in the same USB packet. On devices whose output port 0
+ * feeds all the others, a mask of all those ports is sent once, to port 0.
+ */
+struct motu_hwdep_multicast {
+	__u32 ports; // bit n for output port n
+	__u8 len; // valid bytes in data
+	__u8 reserved[3];
+	__u8 data[MOTU_HWDEP_EVENT_DATA];
+};
+
+#define MOTU_HWDEP_IOCTL_MULTICAST                                             \
+	_IOW('H', 0xf0, struct motu_hwdep_multicast)
+
+/*
+ * MOTU_HWDEP_IOCTL_CLOCK runs a 24 ppqn MIDI clock generator on every output
+ * port set in ports. START and CONTINUE send FA or FB and then clock bytes
+ * at the tempo, STOP sends FC and ends them, TEMPO only changes the tempo
+ * from the next clock on. A tempo of 0 keeps the one set before. The clocks
+ * stop when the device is closed.
+ */
+#define MOTU_HWDEP_CLOCK_STOP 0
+#define MOTU_HWDEP_CLOCK_START 1
+#define MOTU_HWDEP_CLOCK_CONTINUE 2
+#define MOTU_HWDEP_CLOCK_TEMPO 3
+
+#define MOTU_HWDEP_CLOCK_TEMPO_MIN 1000 // 1 bpm
+#define MOTU_HWDEP_CLOCK_TEMPO_MAX 1000000 // 1000 bpm
+
+struct motu_hwdep_clock {
+	__u32 ports; // bit n for output port n
+	__u32 tempo; // quarter notes per minute * 1000
+	__u8 command;
+	__u8 reserved[7];
+};
+
+#define MOTU_HWDEP_IOCTL_CLOCK _IOW('H', 0xf1, struct motu_hwdep_clock)
+
+/*
+ * MOTU_HWDEP_IOCTL_ROUTE passes the messages received on in_port straight
+ * on to the output ports in out_ports, on top of handing them to
+ * userspace. Channel messages pass if their channel is set in channels,
+ * system and realtime messages if MOTU_HWDEP_ROUTE_SYSTEM is set in flags,
+ * sysex only up to 64 bytes. An out_ports of 0 removes the route. Routes
+ * stay when the device is closed.
+ */
+#define MOTU_HWDEP_ROUTE_SYSTEM 0x01
+
+struct motu_hwdep_route {
+	__u8 in_port;
+	__u8 flags;
+	__u16 channels; // bit n for MIDI channel n + 1
+	__u32 out_ports; // bit n for output port n
+};
+
+#define MOTU_HWDEP_IOCTL_ROUTE _IOW('H', 0xf2, struct motu_hwdep_route)
+
+#endif /* MOTU_HWDEP_H */
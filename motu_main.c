@@ -0,0 +1,2273 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   MOTU midi express 128 driver
+ *   Code based on the Behringer BCD2000 driver
+ *
+ *   Copyright (C) 2014 vampirefrog (motu-usb@vampi.tech)
+ *   touched 2022 lost-bit (lost-bit@tripod-systems.de)
+ *     support for micro express & micro lite added
+ */
+
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/usb.h>
+#include <linux/usb/audio.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <sound/control.h>
+#include <sound/core.h>
+#include <sound/hwdep.h>
+#include <sound/info.h>
+#include <sound/initval.h>
+#include <sound/rawmidi.h>
+
+#include "motu_codec.h"
+#include "motu_hwdep.h"
+
+#define PREFIX "snd-motu: "
+#define BUFSIZE 128
+#define NUM_ISO 4
+#define MAX_IN_URBS 8
+#define MAX_OUT_URBS 4
+#define MOTU_EVENT_RING 256 // timestamped input records, power of two
+#define MOTU_SCHED_QUEUE 32 // scheduled output records per port
+#define MOTU_SCHED_INJECT 64
+#define MOTU_OUT_DRAIN_MS 100 // how long a close waits for the output
+/* ns per clock at a tempo of 1/1000 bpm, 24 clocks per quarter note */
+#define MOTU_CLOCK_NS 2500000000000ULL
+
+typedef enum {
+	express_128,
+	micro_express,
+	micro_lite,
+	express_xt
+} en_motu_devices;
+
+static const struct usb_device_id id_table[] = {
+	{USB_DEVICE(0x07fd, 0x0001)},
+	{},
+};
+
+struct motu_port {
+	struct snd_rawmidi_substream *substream;
+};
+
+/*
+ * Scheduled output of one port. Due messages wait in inject until the
+ * rawmidi stream of the port is between two messages, the stream state
+ * below tracks that and the running status that has to be restored.
+ */
+struct motu_sched_port {
+	struct motu_hwdep_event queue[MOTU_SCHED_QUEUE]; // sorted by tstamp
+	int queued;
+	unsigned char inject[MOTU_SCHED_INJECT];
+	int inject_len;
+	int inject_pos;
+
+	unsigned char status;
+	unsigned char remaining;
+	bool sysex;
+	bool restore_status;
+	unsigned char peeked; // where the bytes of the last transmit came from
+};
+
+enum { MOTU_PEEK_RAWMIDI, MOTU_PEEK_INJECT, MOTU_PEEK_STATUS };
+
+/*
+ * MIDI clock generator of one port. Clock n is due at start + n periods,
+ * computed from the start so that rounding does not add up.
+ */
+struct motu_clock_port {
+	bool running;
+	u32 tempo; // bpm * 1000, 0 if never set
+	u64 start; // time of clock 0, ns
+	u64 tick; // next clock
+
+	/* how late clocks were released against their frame, ns */
+	u64 ticks;
+	u64 late_sum;
+	u64 late_max;
+	unsigned int dropped; // the realtime lane was full
+};
+
+/* messages of an input port passed straight on to output ports */
+struct motu_thru_port {
+	u32 out_ports; // no route if 0
+	u16 channels;
+	u8 flags;
+	unsigned char msg[MOTU_SCHED_INJECT]; // message being put together
+	int len;
+	int need; // length of a complete message
+	unsigned int dropped; // messages that did not fit an output
+};
+
+struct motu;
+
+struct motu_urb {
+	struct motu *motu;
+	struct urb *urb;
+	unsigned char buf[BUFSIZE];
+};
+
+struct motu {
+	struct usb_device *dev;
+	struct snd_card *card;
+	struct usb_interface *intf;
+	int card_index;
+
+	int midi_out_active; // number of output URBs in flight
+	atomic_t out_open; // open output substreams
+	wait_queue_head_t out_wait; // the last output URB completed
+	struct snd_rawmidi *rmidi;
+	struct motu_port in_ports[MOTU_MAX_PORTS];
+	struct motu_port out_ports[MOTU_MAX_PORTS];
+	struct motu_codec codec;
+	unsigned char *in_bufs; // input staging rings of the codec
+	unsigned char *out_bufs; // protocol 2 output fifos of the codec
+
+	struct motu_urb out_urbs[MAX_OUT_URBS];
+	int n_out_urbs;
+	unsigned long out_urbs_free; // bitmask of idle out_urbs
+
+	struct motu_urb in_urbs[MAX_IN_URBS];
+	int n_in_urbs;
+	atomic_t in_urbs_queued;
+	unsigned int in_ring_dry; // completions with no other URB queued
+
+	/*
+	 * Adaptive polling, under in_lock. After idle_after_ms without input
+	 * the URBs are parked as they complete, and the last one is only
+	 * resubmitted every idle_poll_ms until a packet brings data.
+	 */
+	bool in_active; // the packet being decoded had data for userspace
+	bool in_idle;
+	bool in_suspended; // nothing is resubmitted until motu_resume()
+	unsigned long in_parked; // bitmask of in_urbs waiting for the timer
+	struct hrtimer idle_timer;
+	u64 in_last_data; // completion with data, ns
+	u64 in_last_poll; // last completion, ns
+	u64 in_completions;
+	u64 in_idle_completions;
+	unsigned int in_idle_periods;
+	unsigned int in_wakes; // idle periods ended by data
+	u64 in_wake_sum; // time since the poll before the one that woke us
+	u64 in_wake_max;
+
+	struct usb_anchor anchor;
+
+	/* URB errors, the per port counters are kept by the codec */
+	unsigned int in_urb_errors; // completions with an error, under in_lock
+	unsigned int out_urb_errors; // under spinlock
+	atomic_t in_submit_errors;
+	unsigned int out_submit_errors; // under spinlock
+
+	/*
+	 * Runtime PM. Open rawmidi substreams, the hwdep device and MIDI thru
+	 * routes each hold a reference, the device autosuspends without them.
+	 */
+	struct mutex pm_mutex; // serializes thru_pm
+	bool thru_pm; // the routes hold a reference
+	unsigned int pm_suspends;
+	unsigned int pm_resumes;
+	unsigned int pm_open_resumes; // resumes an open had to wait for
+	u64 pm_resume_sum;
+	u64 pm_resume_max;
+
+	en_motu_devices motu_type;
+	int n_ports_in;
+	int n_ports_out;
+	bool out_port_all; // output port 0 sends to all the others
+
+	struct snd_hwdep *hwdep;
+	struct dentry *debugfs;
+	bool hwdep_open;
+	struct file *hwdep_file; // the one opener, for its O_NONBLOCK
+	wait_queue_head_t ev_wait;
+	struct motu_hwdep_event events[MOTU_EVENT_RING]; // under in_lock
+	unsigned int ev_head;
+	unsigned int ev_tail;
+	unsigned int ev_lost;
+	bool ev_overrun; // flag the next record
+	struct motu_thru_port thru[MOTU_MAX_PORTS]; // under in_lock
+	bool thru_queued; // output to send after the input packet
+
+	struct motu_sched_port sched[MOTU_MAX_PORTS]; // under spinlock
+	struct motu_clock_port clock[MOTU_MAX_PORTS]; // under spinlock
+	struct hrtimer sched_timer;
+	unsigned int sched_late; // messages released after their frame
+
+	spinlock_t spinlock;
+	spinlock_t in_lock;
+};
+
+static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
+static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
+static int in_urbs = 4;
+static int out_urbs = 2;
+static int in_buf_size = MOTU_IN_BUF_SIZE;
+static int out_buf_size = MOTU_OUT_BUF_SIZE;
+static bool running_status = true;
+static int idle_poll_ms;
+static int idle_after_ms = 1000;
+
+module_param(in_urbs, int, 0444);
+MODULE_PARM_DESC(in_urbs, "Number of input URBs kept in flight (1-8)");
+module_param(out_urbs, int, 0444);
+MODULE_PARM_DESC(out_urbs, "Number of output URBs kept in flight (1-4)");
+module_param(in_buf_size, int, 0444);
+MODULE_PARM_DESC(in_buf_size,
+		 "Input staging buffer per port in bytes (power of two)");
+module_param(out_buf_size, int, 0444);
+MODULE_PARM_DESC(out_buf_size,
+		 "Output buffer per port in bytes (power of two, protocol 2)");
+module_param(running_status, bool, 0444);
+MODULE_PARM_DESC(running_status,
+		 "Leave out repeated status bytes on output (default on)");
+module_param(idle_poll_ms, int, 0644);
+MODULE_PARM_DESC(idle_poll_ms,
+		 "Input poll interval in ms while idle, 0 polls every frame");
+module_param(idle_after_ms, int, 0644);
+MODULE_PARM_DESC(idle_after_ms,
+		 "Time without input before polling slows down in ms");
+
+static DEFINE_MUTEX(devices_mutex);
+static DECLARE_BITMAP(devices_used, SNDRV_CARDS);
+static struct usb_driver motu_driver;
+
+#ifdef CONFIG_SND_DEBUG
+static void motu_dump_buffer(const char *prefix, const char *buf, int len)
+{
+	print_hex_dump(KERN_DEBUG, prefix, DUMP_PREFIX_NONE, 16, 1, buf, len,
+		       false);
+}
+#else
+static void motu_dump_buffer(const char *prefix, const char *buf, int len)
+{
+}
+#endif
+
+/*
+ * Keep the device awake for an open. usb_autopm_get_interface() resumes a
+ * suspended device before it returns, so the time it took is how long the
+ * open waited for the device.
+ */
+static int motu_pm_get(struct motu *motu)
+{
+	struct usb_interface *intf = READ_ONCE(motu->intf);
+	unsigned int resumes = READ_ONCE(motu->pm_resumes);
+	u64 start = ktime_get_ns(), t;
+	unsigned long flags;
+	int err;
+
+	if (!intf)
+		return -ENODEV;
+
+	err = usb_autopm_get_interface(intf);
+	if (err < 0)
+		return err;
+
+	if (READ_ONCE(motu->pm_resumes) != resumes) {
+		t = ktime_get_ns() - start;
+		spin_lock_irqsave(&motu->in_lock, flags);
+		motu->pm_open_resumes++;
+		motu->pm_resume_sum += t;
+		motu->pm_resume_max = max(motu->pm_resume_max, t);
+		spin_unlock_irqrestore(&motu->in_lock, flags);
+	}
+
+	return 0;
+}
+
+static void motu_pm_put(struct motu *motu)
+{
+	struct usb_interface *intf = READ_ONCE(motu->intf);
+
+	// after a disconnect the USB core has dropped our references
+	if (intf)
+		usb_autopm_put_interface(intf);
+}
+
+static int motu_midi_input_open(struct snd_rawmidi_substream *substream)
+{
+	return motu_pm_get(substream->rmidi->private_data);
+}
+
+static int motu_midi_input_close(struct snd_rawmidi_substream *substream)
+{
+	motu_pm_put(substream->rmidi->private_data);
+	return 0;
+}
+
+/* (de)register midi substream from client */
+static void motu_midi_input_trigger(struct snd_rawmidi_substream *substream,
+				    int up)
+{
+	struct motu *motu = substream->rmidi->private_data;
+
+	if (substream->number >= motu->n_ports_in)
+		return;
+
+	motu->in_ports[substream->number].substream = up ? substream : NULL;
+}
+
+/* queue received bytes for the hwdep reader, called under in_lock */
+static void motu_hwdep_queue(struct motu *motu, int port,
+			     const unsigned char *buf, int len)
+{
+	struct motu_hwdep_event *ev;
+	int n;
+
+	while (len > 0) {
+		if (motu->ev_head - motu->ev_tail >= MOTU_EVENT_RING) {
+			motu->ev_lost++;
+			motu->ev_overrun = true;
+			return;
+		}
+
+		n = min(len, MOTU_HWDEP_EVENT_DATA);
+		ev = &motu->events[motu->ev_head & (MOTU_EVENT_RING - 1)];
+		memset(ev, 0, sizeof(*ev));
+		ev->tstamp = motu->codec.in_tstamp;
+		ev->port = port;
+		ev->len = n;
+		if (motu->codec.clock.valid)
+			ev->flags |= MOTU_HWDEP_EVENT_FRAME_CLOCK;
+		if (motu->ev_overrun)
+			ev->flags |= MOTU_HWDEP_EVENT_OVERRUN;
+		memcpy(ev->data, buf, n);
+
+		motu->ev_overrun = false;
+		motu->ev_head++;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Queue a routed message on the output ports of its route, between the
+ * messages of their rawmidi streams or on the realtime lane. Called under
+ * in_lock, the spinlock nests inside it.
+ */
+static void motu_thru_send(struct motu *motu, struct motu_thru_port *thru,
+			   const unsigned char *msg, int len)
+{
+	struct motu_sched_port *sched;
+	unsigned long ports = thru->out_ports;
+	int p;
+
+	if (msg[0] < 0xf0 ? !(thru->channels & BIT(msg[0] & 0x0f))
+			  : !(thru->flags & MOTU_HWDEP_ROUTE_SYSTEM))
+		return;
+
+	spin_lock(&motu->spinlock);
+	for_each_set_bit(p, &ports, motu->n_ports_out) {
+		sched = &motu->sched[p];
+		if (msg[0] >= 0xf8 &&
+		    motu_codec_queue_realtime(&motu->codec, p, msg[0]))
+			continue;
+		if (sched->inject_len + len > MOTU_SCHED_INJECT) {
+			thru->dropped++;
+			continue;
+		}
+		memcpy(sched->inject + sched->inject_len, msg, len);
+		sched->inject_len += len;
+	}
+	spin_unlock(&motu->spinlock);
+	motu->thru_queued = true;
+}
+
+/* put the received bytes of a port back together into whole messages */
+static void motu_thru(struct motu *motu, int port, const unsigned char *buf,
+		      int len)
+{
+	struct motu_thru_port *thru = &motu->thru[port];
+	unsigned char b;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		b = buf[i];
+		if (b >= 0xf8) { // realtime goes on its own
+			motu_thru_send(motu, thru, &b, 1);
+			continue;
+		}
+
+		if (thru->len && thru->msg[0] == 0xf0 &&
+		    (b < 0x80 || b == 0xf7)) {
+			if (thru->len == sizeof(thru->msg)) {
+				// too long for the inject buffers
+				thru->len = 0;
+				thru->dropped++;
+				continue;
+			}
+		} else if (b & 0x80) {
+			thru->len = 0;
+			if (b == 0xf7) // end of a sysex that was dropped
+				continue;
+			thru->need = b == 0xf0 ? 0 :
+				     max(motu_get_cmd_num_bytes(b), 1);
+		} else if (!thru->len) {
+			// the decoders repeat the status, realtime in between
+			// included, so this is the rest of a dropped sysex
+			continue;
+		}
+		thru->msg[thru->len++] = b;
+
+		if (thru->len == thru->need || b == 0xf7) {
+			motu_thru_send(motu, thru, thru->msg, thru->len);
+			thru->len = 0;
+		}
+	}
+}
+
+static void motu_receive(struct motu_codec *codec, int port,
+			 const unsigned char *buf, int len)
+{
+	struct motu *motu = codec->private_data;
+	struct snd_rawmidi_substream *midi_receive_substream;
+
+	motu_dump_buffer(PREFIX "sending to userspace: ", buf, len);
+	motu->in_active = true;
+
+	midi_receive_substream = READ_ONCE(motu->in_ports[port].substream);
+	if (midi_receive_substream)
+		snd_rawmidi_receive(midi_receive_substream, buf, len);
+
+	if (motu->hwdep_open)
+		motu_hwdep_queue(motu, port, buf, len);
+
+	if (motu->thru[port].out_ports)
+		motu_thru(motu, port, buf, len);
+}
+
+/* follow the message boundaries of the bytes sent on a port */
+static void motu_sched_track(struct motu_sched_port *sched,
+			     const unsigned char *buf, int len)
+{
+	unsigned char b;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		b = buf[i];
+		if (b >= 0xf8) // realtime goes anywhere
+			continue;
+		if (b & 0x80) {
+			sched->sysex = b == 0xf0;
+			sched->status = b < 0xf0 ? b : 0;
+			sched->remaining =
+				max(motu_get_cmd_num_bytes(b) - 1, 0);
+		} else if (sched->sysex) {
+			continue;
+		} else if (sched->remaining) {
+			sched->remaining--;
+		} else if (sched->status) {
+			// running status, this is the first data byte
+			sched->remaining =
+				motu_get_cmd_num_bytes(sched->status) - 2;
+		}
+	}
+}
+
+/*
+ * Look at the bytes a port wants to send without taking them, the codec
+ * acks what it could queue and the rest stays in the rawmidi buffer.
+ */
+static int motu_transmit(struct motu_codec *codec, int port, unsigned char *buf,
+			 int len)
+{
+	struct motu *motu = codec->private_data;
+	struct motu_sched_port *sched = &motu->sched[port];
+	struct snd_rawmidi_substream *midi_out_substream;
+	int ret;
+
+	/* due scheduled messages go out between two messages of the stream */
+	if (sched->inject_pos < sched->inject_len && !sched->sysex &&
+	    !sched->remaining) {
+		ret = min(len, sched->inject_len - sched->inject_pos);
+		memcpy(buf, sched->inject + sched->inject_pos, ret);
+		sched->peeked = MOTU_PEEK_INJECT;
+		return ret;
+	}
+
+	midi_out_substream = READ_ONCE(motu->out_ports[port].substream);
+	if (!midi_out_substream || len <= 0)
+		return 0;
+
+	/* the device saw another status, repeat the one the stream relies on */
+	if (sched->restore_status) {
+		ret = snd_rawmidi_transmit_peek(midi_out_substream, buf, 1);
+		if (ret <= 0)
+			return 0;
+		if (!(buf[0] & 0x80)) {
+			buf[0] = sched->status;
+			sched->peeked = MOTU_PEEK_STATUS;
+			return 1;
+		}
+		sched->restore_status = false;
+	}
+
+	ret = snd_rawmidi_transmit_peek(midi_out_substream, buf, len);
+	if (ret < 0)
+		dev_err(&motu->dev->dev,
+			"%s: snd_rawmidi_transmit_peek error %d\n", __func__,
+			ret);
+	sched->peeked = MOTU_PEEK_RAWMIDI;
+
+	return ret;
+}
+
+static void motu_transmit_ack(struct motu_codec *codec, int port,
+			      const unsigned char *buf, int len)
+{
+	struct motu *motu = codec->private_data;
+	struct motu_sched_port *sched = &motu->sched[port];
+	struct snd_rawmidi_substream *midi_out_substream;
+
+	if (len <= 0)
+		return;
+
+	switch (sched->peeked) {
+	case MOTU_PEEK_INJECT:
+		sched->inject_pos += len;
+		if (sched->inject_pos == sched->inject_len)
+			sched->inject_pos = sched->inject_len = 0;
+		if (sched->status)
+			sched->restore_status = true;
+		break;
+	case MOTU_PEEK_STATUS:
+		sched->restore_status = false;
+		break;
+	case MOTU_PEEK_RAWMIDI:
+		midi_out_substream = READ_ONCE(motu->out_ports[port].substream);
+		if (midi_out_substream)
+			snd_rawmidi_transmit_ack(midi_out_substream, len);
+		motu_sched_track(sched, buf, len);
+		break;
+	}
+}
+
+static const struct motu_codec_ops motu_codec_ops = {
+	.receive = motu_receive,
+	.transmit = motu_transmit,
+	.transmit_ack = motu_transmit_ack,
+};
+
+/* encode the next packet into urb, returns its length or 0 if idle */
+static int motu_midi_send_prot1(struct motu *motu, struct urb *urb)
+{
+	int outlen;
+
+	outlen = motu_midi_encode_prot1(&motu->codec, urb->transfer_buffer,
+					BUFSIZE);
+	if (outlen <= 0)
+		return 0;
+
+	/* set payload length */
+	urb->transfer_buffer_length = outlen;
+
+	motu_dump_buffer(PREFIX "sending to device: ", urb->transfer_buffer,
+			 outlen);
+
+	return outlen;
+}
+
+/* encode the next packet into urb, returns its length or 0 if idle */
+static int motu_midi_send_prot2(struct motu *motu, struct urb *urb)
+{
+	int i, j, k;
+	int out_count, out_offset;
+
+	/* only NUM_ISO frames go out, anything beyond them would be lost */
+	i = motu_midi_encode_prot2(&motu->codec, urb->transfer_buffer,
+				   NUM_ISO * 14);
+	if (i <= 0)
+		return 0;
+
+	out_count = i;
+	out_offset = 0;
+	k = 0;
+	while (out_count > 0) {
+		if (out_count > 14)
+			j = 14;
+		else
+			j = out_count;
+		if (k < NUM_ISO) {
+			urb->iso_frame_desc[k].offset = out_offset;
+			urb->iso_frame_desc[k].length = j;
+			urb->iso_frame_desc[k].status = 0;
+			k++;
+		}
+		out_offset += j;
+		out_count -= j;
+	}
+	urb->number_of_packets = k;
+
+	motu_dump_buffer(PREFIX "sending to device   : ", urb->transfer_buffer,
+			 i);
+
+	return i;
+}
+
+/* encode and submit packets while there are idle output URBs */
+static void motu_midi_send(struct motu *motu)
+{
+	struct urb *urb;
+	int slot, len, ret;
+
+	while (motu->out_urbs_free) {
+		slot = __ffs(motu->out_urbs_free);
+		urb = motu->out_urbs[slot].urb;
+
+		len = 0;
+		switch (motu->motu_type) {
+		case express_128:
+		case micro_lite:
+			len = motu_midi_send_prot1(motu, urb);
+			break;
+		case micro_express:
+		case express_xt:
+			len = motu_midi_send_prot2(motu, urb);
+			break;
+		}
+		if (len <= 0)
+			break;
+
+		/* send packet to the MOTU */
+		ret = usb_submit_urb(urb, GFP_ATOMIC);
+		if (ret < 0) {
+			motu->out_submit_errors++;
+			dev_err_ratelimited(&motu->dev->dev,
+					    PREFIX "%s: usb_submit_urb() "
+						   "failed, ret=%d, "
+						   "outlen=%d\n",
+					    __func__, ret, len);
+			break;
+		}
+
+		motu->out_urbs_free &= ~BIT(slot);
+		motu->midi_out_active++;
+	}
+}
+
+/*
+ * A message due at t is released at the start of the USB frame before the
+ * one t falls into, so the packet goes out in the frame of its deadline.
+ * The frame boundaries come from the input frame clock, without it the
+ * message is simply released one frame early.
+ */
+static u64 motu_sched_release_time(struct motu *motu, u64 t)
+{
+	const struct motu_frame_clock *clock = &motu->codec.clock;
+	u32 rem = 0;
+
+	if (clock->valid && t > clock->tstamp)
+		div_u64_rem(t - clock->tstamp, MOTU_FRAME_NS, &rem);
+
+	return t - rem - MOTU_FRAME_NS;
+}
+
+static bool motu_is_realtime(const u8 *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (data[i] < 0xf8)
+			return false;
+	return true;
+}
+
+/* realtime bytes go on the priority lane of the codec if they all fit */
+static bool motu_queue_realtime(struct motu *motu, int port, const u8 *data,
+				int len)
+{
+	int i;
+
+	if (!motu_is_realtime(data, len) ||
+	    motu->codec.out_rt[port].len + len > MOTU_OUT_RT_SIZE)
+		return false;
+	for (i = 0; i < len; i++)
+		motu_codec_queue_realtime(&motu->codec, port, data[i]);
+	return true;
+}
+
+/*
+ * Move due messages to the inject buffers, or realtime ones to the
+ * priority lane, which does not wait for the stream to reach the end of a
+ * message. Called under spinlock.
+ */
+static void motu_sched_release(struct motu *motu, u64 now)
+{
+	struct motu_sched_port *sched;
+	struct motu_hwdep_event *ev;
+	int p;
+
+	for (p = 0; p < motu->n_ports_out; p++) {
+		sched = &motu->sched[p];
+		while (sched->queued) {
+			ev = &sched->queue[0];
+			if (motu_sched_release_time(motu, ev->tstamp) > now)
+				break;
+			if (!motu_queue_realtime(motu, p, ev->data, ev->len)) {
+				if (sched->inject_len + ev->len >
+				    MOTU_SCHED_INJECT)
+					break;
+				memcpy(sched->inject + sched->inject_len,
+				       ev->data, ev->len);
+				sched->inject_len += ev->len;
+			}
+			if (now > ev->tstamp)
+				motu->sched_late++;
+			sched->queued--;
+			memmove(ev, ev + 1, sched->queued * sizeof(*ev));
+		}
+	}
+}
+
+static u64 motu_clock_next(const struct motu_clock_port *clock)
+{
+	return clock->start + div_u64(clock->tick * MOTU_CLOCK_NS,
+				      clock->tempo);
+}
+
+/* put due clocks on the realtime lanes, called under spinlock */
+static void motu_clock_release(struct motu *motu, u64 now)
+{
+	struct motu_clock_port *clock;
+	u64 t, late;
+	int p;
+
+	for (p = 0; p < motu->n_ports_out; p++) {
+		clock = &motu->clock[p];
+		if (!clock->running)
+			continue;
+		for (;;) {
+			t = motu_sched_release_time(motu,
+						    motu_clock_next(clock));
+			if (t > now)
+				break;
+			if (motu_codec_queue_realtime(&motu->codec, p, 0xf8)) {
+				late = now - t;
+				clock->ticks++;
+				clock->late_sum += late;
+				clock->late_max = max(clock->late_max, late);
+			} else {
+				clock->dropped++;
+			}
+			// keep tick * MOTU_CLOCK_NS well within 64 bits
+			if (++clock->tick == 65536) {
+				clock->start = motu_clock_next(clock);
+				clock->tick = 0;
+			}
+		}
+	}
+}
+
+/* wake up for the earliest queued message or clock, under spinlock */
+static void motu_sched_arm(struct motu *motu)
+{
+	u64 next = U64_MAX, now, t;
+	int p;
+
+	for (p = 0; p < motu->n_ports_out; p++) {
+		if (motu->sched[p].queued)
+			next = min(next, motu->sched[p].queue[0].tstamp);
+		if (motu->clock[p].running)
+			next = min(next, motu_clock_next(&motu->clock[p]));
+	}
+	if (next == U64_MAX)
+		return;
+
+	// a due message that did not fit is retried a frame later
+	now = ktime_get_ns();
+	t = motu_sched_release_time(motu, next);
+	if (t <= now)
+		t = now + MOTU_FRAME_NS;
+
+	hrtimer_start(&motu->sched_timer, ns_to_ktime(t), HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart motu_sched_timer(struct hrtimer *timer)
+{
+	struct motu *motu = container_of(timer, struct motu, sched_timer);
+	unsigned long flags;
+	u64 now;
+
+	spin_lock_irqsave(&motu->spinlock, flags);
+	now = ktime_get_ns();
+	motu_sched_release(motu, now);
+	motu_clock_release(motu, now);
+	motu_midi_send(motu);
+	motu_sched_arm(motu);
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static int motu_midi_output_open(struct snd_rawmidi_substream *substream)
+{
+	struct motu *motu = substream->rmidi->private_data;
+	int err;
+
+	err = motu_pm_get(motu);
+	if (err < 0)
+		return err;
+	atomic_inc(&motu->out_open);
+
+	return 0;
+}
+
+/*
+ * The output URBs are shared by all ports and carry bytes that were taken
+ * from the rawmidi buffers already, so they are left to complete. The last
+ * output to close waits for them, and for what the protocol 2 fifos still
+ * hold, before the device may autosuspend.
+ */
+static int motu_midi_output_close(struct snd_rawmidi_substream *substream)
+{
+	struct motu *motu = substream->rmidi->private_data;
+
+	if (atomic_dec_return(&motu->out_open) == 0)
+		wait_event_timeout(motu->out_wait,
+				   !READ_ONCE(motu->midi_out_active) ||
+					   !READ_ONCE(motu->intf),
+				   msecs_to_jiffies(MOTU_OUT_DRAIN_MS));
+	motu_pm_put(motu);
+
+	return 0;
+}
+
+/* (de)register midi substream from client */
+static void motu_midi_output_trigger(struct snd_rawmidi_substream *substream,
+				     int up)
+{
+	struct motu *motu;
+	unsigned long flags;
+
+	if (substream == NULL)
+		return;
+	if (substream->rmidi == NULL)
+		return;
+	if (substream->rmidi->private_data == NULL)
+		return;
+
+	motu = substream->rmidi->private_data;
+	spin_lock_irqsave(&motu->spinlock, flags);
+
+	if (up) {
+		motu->out_ports[substream->number].substream = substream;
+		/* check if there is data userspace wants to send */
+		motu_midi_send(motu);
+	} else {
+		motu->out_ports[substream->number].substream = NULL;
+	}
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+}
+
+static void motu_output_complete(struct urb *urb)
+{
+	struct motu_urb *out_urb = urb->context;
+	struct motu *motu;
+	unsigned long flags;
+
+	if (urb->status)
+		dev_warn_ratelimited(&urb->dev->dev,
+				     PREFIX "output urb->status: %d\n",
+				     urb->status);
+
+	if (urb->status == -ESHUTDOWN)
+		return;
+
+	motu = out_urb ? out_urb->motu : NULL;
+	if (!motu)
+		return;
+
+	spin_lock_irqsave(&motu->spinlock, flags);
+	motu->out_urbs_free |= BIT(out_urb - motu->out_urbs);
+	motu->midi_out_active--;
+	if (!motu->midi_out_active)
+		wake_up(&motu->out_wait);
+	if (urb->status && urb->status != -ENOENT &&
+	    urb->status != -ECONNRESET)
+		motu->out_urb_errors++;
+
+	/* check if there is more data userspace wants to send */
+	if (urb->status != -ENOENT && urb->status != -ECONNRESET)
+		motu_midi_send(motu);
+
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+}
+
+static int motu_submit_in_urb(struct motu *motu, struct urb *urb, gfp_t mem)
+{
+	int ret;
+
+	usb_anchor_urb(urb, &motu->anchor);
+	atomic_inc(&motu->in_urbs_queued);
+	ret = usb_submit_urb(urb, mem);
+	if (ret < 0) {
+		atomic_dec(&motu->in_urbs_queued);
+		atomic_inc(&motu->in_submit_errors);
+		usb_unanchor_urb(urb);
+	}
+
+	return ret;
+}
+
+/*
+ * Decide what happens to an input URB that just completed, called under
+ * in_lock. Returns true if it is parked. Once a packet brings data again,
+ * the parked URBs are returned in wake and go back in flight with it.
+ */
+static bool motu_in_adapt(struct motu *motu, int slot, u64 now,
+			  unsigned long *wake)
+{
+	u64 poll = (u64)clamp(READ_ONCE(idle_poll_ms), 0, 100) * NSEC_PER_MSEC;
+	u64 after = (u64)max(READ_ONCE(idle_after_ms), 0) * NSEC_PER_MSEC;
+	u64 last_poll = motu->in_last_poll;
+	bool active = motu->in_active;
+
+	if (motu->in_suspended) // motu_resume() submits all of them again
+		return true;
+
+	motu->in_last_poll = now;
+	motu->in_active = false;
+	if (active)
+		motu->in_last_data = now;
+
+	if (!motu->in_idle) {
+		if (active || !poll || now - motu->in_last_data < after)
+			return false;
+		motu->in_idle = true;
+		motu->in_idle_periods++;
+	} else if (active || !poll) {
+		motu->in_idle = false;
+		if (active) {
+			// how long the data may have waited for this poll
+			motu->in_wakes++;
+			motu->in_wake_sum += now - last_poll;
+			motu->in_wake_max =
+				max(motu->in_wake_max, now - last_poll);
+		}
+		*wake = motu->in_parked;
+		motu->in_parked = 0;
+		return false;
+	}
+
+	if (motu->card->shutdown) // no more timers
+		return false;
+
+	/* the last URB in flight polls again after the idle interval */
+	motu->in_parked |= BIT(slot);
+	if (!atomic_read(&motu->in_urbs_queued))
+		hrtimer_start(&motu->idle_timer, ns_to_ktime(poll),
+			      HRTIMER_MODE_REL);
+	return true;
+}
+
+static void motu_submit_parked(struct motu *motu, unsigned long parked)
+{
+	int i, ret;
+
+	for_each_set_bit(i, &parked, motu->n_in_urbs) {
+		ret = motu_submit_in_urb(motu, motu->in_urbs[i].urb,
+					 GFP_ATOMIC);
+		if (ret < 0)
+			dev_err_ratelimited(&motu->dev->dev,
+					    PREFIX "%s: usb_submit_urb() in %d "
+						   "failed, ret=%d\n",
+					    __func__, i, ret);
+	}
+}
+
+/* poll once more while idle */
+static enum hrtimer_restart motu_idle_timer(struct hrtimer *timer)
+{
+	struct motu *motu = container_of(timer, struct motu, idle_timer);
+	unsigned long flags, parked;
+
+	spin_lock_irqsave(&motu->in_lock, flags);
+	parked = motu->in_parked && !motu->in_suspended
+			 ? BIT(__ffs(motu->in_parked))
+			 : 0;
+	motu->in_parked &= ~parked;
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+
+	motu_submit_parked(motu, parked);
+
+	return HRTIMER_NORESTART;
+}
+
+static void motu_input_complete(struct urb *urb)
+{
+	int ret;
+	struct motu_urb *in_urb = urb->context;
+	struct motu *motu = in_urb ? in_urb->motu : NULL;
+	unsigned long flags;
+	unsigned int ev_head;
+	unsigned long wake = 0;
+	bool thru, park;
+	u64 now;
+
+	if (urb->status && urb->status != -ENOENT)
+		dev_warn_ratelimited(&urb->dev->dev,
+				     PREFIX "input urb->status: %i\n",
+				     urb->status);
+
+	/* killed by motu_suspend(), motu_resume() submits it again */
+	if (!motu || urb->status == -ESHUTDOWN || urb->status == -ENOENT)
+		return;
+
+	/*
+	 * The host controller gives back the URBs of the input endpoint in
+	 * the order they were submitted, so parsing them one at a time under
+	 * in_lock keeps the running status in in_ports and in_state intact.
+	 */
+	now = ktime_get_ns();
+	spin_lock_irqsave(&motu->in_lock, flags);
+	if (atomic_dec_return(&motu->in_urbs_queued) == 0 && !motu->in_idle)
+		motu->in_ring_dry++;
+	ev_head = motu->ev_head;
+
+	motu->in_completions++;
+	if (motu->in_idle)
+		motu->in_idle_completions++;
+	if (urb->status)
+		motu->in_urb_errors++;
+
+	if (urb->actual_length > 0) {
+		motu_dump_buffer(PREFIX "received from device: ",
+				 urb->transfer_buffer, urb->actual_length);
+
+		switch (motu->motu_type) {
+		case express_128:
+		case micro_lite:
+			// byte 0 is the frame counter of the device
+			motu->codec.in_tstamp = motu_frame_clock_update(
+				&motu->codec.clock, in_urb->buf[0], now);
+			motu_midi_handle_input_prot1(&motu->codec,
+						     urb->transfer_buffer,
+						     urb->actual_length);
+			break;
+		case micro_express:
+		case express_xt:
+			motu->codec.in_tstamp = now;
+			motu_midi_handle_input_prot2(&motu->codec,
+						     urb->transfer_buffer,
+						     urb->actual_length);
+			break;
+		}
+	}
+	thru = motu->thru_queued;
+	motu->thru_queued = false;
+	park = motu_in_adapt(motu, in_urb - motu->in_urbs, now, &wake);
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+
+	if (motu->ev_head != ev_head)
+		wake_up_interruptible(&motu->ev_wait);
+
+	/* routed messages go out in the next frame */
+	if (thru) {
+		spin_lock_irqsave(&motu->spinlock, flags);
+		motu_midi_send(motu);
+		spin_unlock_irqrestore(&motu->spinlock, flags);
+	}
+
+	if (park)
+		return;
+
+	/* return URB to the tail of the ring, and the parked ones after it */
+	ret = motu_submit_in_urb(motu, urb, GFP_ATOMIC);
+	if (ret < 0)
+		dev_err_ratelimited(&motu->dev->dev,
+				    PREFIX "%s: usb_submit_urb() failed, "
+					   "ret=%d\n",
+				    __func__, ret);
+	motu_submit_parked(motu, wake);
+}
+
+static const struct snd_rawmidi_ops motu_midi_output = {
+	.open = motu_midi_output_open,
+	.close = motu_midi_output_close,
+	.trigger = motu_midi_output_trigger,
+};
+
+static const struct snd_rawmidi_ops motu_midi_input = {
+	.open = motu_midi_input_open,
+	.close = motu_midi_input_close,
+	.trigger = motu_midi_input_trigger,
+};
+
+static void motu_init_device(struct motu *motu)
+{
+	int ret, i;
+
+	motu->midi_out_active = 0;
+	motu->out_urbs_free = BIT(motu->n_out_urbs) - 1;
+	atomic_set(&motu->in_urbs_queued, 0);
+	motu->in_last_data = ktime_get_ns();
+
+	/*
+	 * Fill the input ring. The input URBs stay anchored while they are
+	 * in flight, so there is no point in waiting for the anchor to drain.
+	 */
+	for (i = 0; i < motu->n_in_urbs; i++) {
+		ret = motu_submit_in_urb(motu, motu->in_urbs[i].urb,
+					 GFP_KERNEL);
+		if (ret < 0)
+			dev_err(&motu->dev->dev,
+				PREFIX "%s: usb_submit_urb() in %d failed, "
+				       "ret=%d\n",
+				__func__, i, ret);
+	}
+}
+
+/*
+ * Copies of the counters of a port, taken under the lock of the path that
+ * updates them so that the 64 bit ones do not tear.
+ */
+static void motu_in_port_get(struct motu *motu, int port,
+			     struct motu_in_port *in)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&motu->in_lock, flags);
+	*in = motu->codec.in_ports[port];
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+}
+
+static void motu_out_stats_get(struct motu *motu, int port,
+			       struct motu_out_stats *out,
+			       unsigned int *saved)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&motu->spinlock, flags);
+	*out = motu->codec.out_stats[port];
+	*saved = motu->codec.out_status[port].saved;
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+}
+
+static void motu_proc_read(struct snd_info_entry *entry,
+			   struct snd_info_buffer *buffer)
+{
+	struct motu *motu = entry->private_data;
+	struct motu_in_port in;
+	struct motu_out_stats out;
+	unsigned int saved;
+	int i;
+
+	snd_iprintf(buffer, "input URBs: %d\n", motu->n_in_urbs);
+	snd_iprintf(buffer, "input URBs queued: %d\n",
+		    atomic_read(&motu->in_urbs_queued));
+	snd_iprintf(buffer, "input ring ran dry: %u\n", motu->in_ring_dry);
+	snd_iprintf(buffer, "input completions: %llu\n", motu->in_completions);
+	snd_iprintf(buffer, "input completions while idle: %llu\n",
+		    motu->in_idle_completions);
+	snd_iprintf(buffer, "input idle periods: %u\n", motu->in_idle_periods);
+	snd_iprintf(buffer, "input wake latency avg/max: %llu/%llu us\n",
+		    div_u64(div_u64(motu->in_wake_sum, max(motu->in_wakes, 1U)),
+			    NSEC_PER_USEC),
+		    div_u64(motu->in_wake_max, NSEC_PER_USEC));
+	snd_iprintf(buffer, "suspends: %u\n", motu->pm_suspends);
+	snd_iprintf(buffer, "resumes: %u\n", motu->pm_resumes);
+	snd_iprintf(buffer, "resumes waited for by an open: %u\n",
+		    motu->pm_open_resumes);
+	snd_iprintf(buffer, "resume time avg/max: %llu/%llu us\n",
+		    div_u64(div_u64(motu->pm_resume_sum,
+				    max(motu->pm_open_resumes, 1U)),
+			    NSEC_PER_USEC),
+		    div_u64(motu->pm_resume_max, NSEC_PER_USEC));
+	snd_iprintf(buffer, "output URBs: %d\n", motu->n_out_urbs);
+	snd_iprintf(buffer, "output URBs in flight: %d\n",
+		    motu->midi_out_active);
+	snd_iprintf(buffer, "input buffer size: %u\n",
+		    motu->codec.in_ports[0].buf_size);
+	snd_iprintf(buffer, "output buffer size: %u\n",
+		    motu->codec.mfifo[0].size);
+	snd_iprintf(buffer, "input URB errors: %u\n", motu->in_urb_errors);
+	snd_iprintf(buffer, "input URB submit errors: %d\n",
+		    atomic_read(&motu->in_submit_errors));
+	snd_iprintf(buffer, "input switches to a missing port: %u\n",
+		    motu->codec.in_bad_port);
+	snd_iprintf(buffer, "output URB errors: %u\n", motu->out_urb_errors);
+	snd_iprintf(buffer, "output URB submit errors: %u\n",
+		    motu->out_submit_errors);
+	for (i = 0; i < motu->n_ports_in; i++) {
+		motu_in_port_get(motu, i, &in);
+		snd_iprintf(buffer,
+			    "input %d: bytes %llu messages %llu expanded %u "
+			    "filtered %u cut %u dropped %u peak %u\n",
+			    i, in.stats.bytes, in.stats.msgs, in.stats.expanded,
+			    in.stats.filtered, in.stats.cut, in.dropped,
+			    in.stats.peak);
+	}
+	for (i = 0; i < motu->n_ports_out; i++) {
+		motu_out_stats_get(motu, i, &out, &saved);
+		snd_iprintf(buffer,
+			    "output %d: bytes %llu messages %llu status bytes "
+			    "saved %u switches %u peak %u\n",
+			    i, out.bytes, out.msgs, saved, out.switches,
+			    out.peak);
+	}
+	for (i = 0; i < motu->n_ports_in; i++) {
+		if (!motu->thru[i].out_ports)
+			continue;
+		snd_iprintf(buffer,
+			    "input %d thru: outputs %#x channels %#06x "
+			    "system %d dropped %u\n",
+			    i, motu->thru[i].out_ports, motu->thru[i].channels,
+			    !!(motu->thru[i].flags & MOTU_HWDEP_ROUTE_SYSTEM),
+			    motu->thru[i].dropped);
+	}
+	snd_iprintf(buffer, "hwdep records lost: %u\n", motu->ev_lost);
+	snd_iprintf(buffer, "scheduled messages late: %u\n", motu->sched_late);
+}
+
+/* clock generators, with how late their clocks left against the grid */
+static int motu_clock_show(struct seq_file *m, void *v)
+{
+	struct motu *motu = m->private;
+	struct motu_clock_port clock;
+	unsigned long flags;
+	int p;
+
+	seq_puts(m, "port running bpm clocks late_avg_ns late_max_ns "
+		    "dropped\n");
+	for (p = 0; p < motu->n_ports_out; p++) {
+		spin_lock_irqsave(&motu->spinlock, flags);
+		clock = motu->clock[p];
+		spin_unlock_irqrestore(&motu->spinlock, flags);
+
+		seq_printf(m, "%d %d %u.%03u %llu %llu %llu %u\n", p,
+			   clock.running, clock.tempo / 1000,
+			   clock.tempo % 1000, clock.ticks,
+			   clock.ticks ? div64_u64(clock.late_sum, clock.ticks)
+				       : 0,
+			   clock.late_max, clock.dropped);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(motu_clock);
+
+/* the counters of every port, one line each, and those of the device */
+static int motu_stats_show(struct seq_file *m, void *v)
+{
+	struct motu *motu = m->private;
+	struct motu_in_port in;
+	struct motu_out_stats out;
+	unsigned int saved;
+	int p;
+
+	seq_puts(m, "input bytes messages expanded filtered cut dropped "
+		    "peak\n");
+	for (p = 0; p < motu->n_ports_in; p++) {
+		motu_in_port_get(motu, p, &in);
+		seq_printf(m, "%d %llu %llu %u %u %u %u %u\n", p,
+			   in.stats.bytes, in.stats.msgs, in.stats.expanded,
+			   in.stats.filtered, in.stats.cut, in.dropped,
+			   in.stats.peak);
+	}
+
+	seq_puts(m, "output bytes messages saved switches peak\n");
+	for (p = 0; p < motu->n_ports_out; p++) {
+		motu_out_stats_get(motu, p, &out, &saved);
+		seq_printf(m, "%d %llu %llu %u %u %u\n", p, out.bytes,
+			   out.msgs, saved, out.switches, out.peak);
+	}
+
+	seq_printf(m, "in_urb_errors %u\n", READ_ONCE(motu->in_urb_errors));
+	seq_printf(m, "in_submit_errors %d\n",
+		   atomic_read(&motu->in_submit_errors));
+	seq_printf(m, "in_bad_port %u\n", READ_ONCE(motu->codec.in_bad_port));
+	seq_printf(m, "out_urb_errors %u\n", READ_ONCE(motu->out_urb_errors));
+	seq_printf(m, "out_submit_errors %u\n",
+		   READ_ONCE(motu->out_submit_errors));
+	seq_puts(m, "thru_dropped");
+	for (p = 0; p < motu->n_ports_in; p++)
+		seq_printf(m, " %u", READ_ONCE(motu->thru[p].dropped));
+	seq_puts(m, "\n");
+	seq_printf(m, "hwdep_lost %u\n", READ_ONCE(motu->ev_lost));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(motu_stats);
+
+static void motu_init_debugfs(struct motu *motu)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "snd-motu-card%d", motu->card->number);
+	motu->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("clock", 0444, motu->debugfs, motu,
+			    &motu_clock_fops);
+	debugfs_create_file("stats", 0444, motu->debugfs, motu,
+			    &motu_stats_fops);
+}
+
+static void motu_init_proc(struct motu *motu)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	snd_card_ro_proc_new(motu->card, "motu", motu, motu_proc_read);
+#else
+	struct snd_info_entry *entry;
+
+	if (!snd_card_proc_new(motu->card, "motu", &entry))
+		snd_info_set_text_ops(entry, motu, motu_proc_read);
+#endif
+}
+
+static int motu_hwdep_open(struct snd_hwdep *hw, struct file *file)
+{
+	struct motu *motu = hw->private_data;
+	unsigned long flags;
+	int err;
+
+	err = motu_pm_get(motu);
+	if (err < 0)
+		return err;
+
+	spin_lock_irqsave(&motu->in_lock, flags);
+	motu->ev_tail = motu->ev_head;
+	motu->ev_overrun = false;
+	motu->hwdep_open = true;
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+	motu->hwdep_file = file;
+
+	return 0;
+}
+
+static int motu_hwdep_release(struct snd_hwdep *hw, struct file *file)
+{
+	struct motu *motu = hw->private_data;
+	unsigned long flags;
+	int p;
+
+	WRITE_ONCE(motu->hwdep_open, false);
+
+	/*
+	 * Messages that are not due yet go away with the file, and running
+	 * clocks stop with a stop byte so the devices behind them do too.
+	 */
+	spin_lock_irqsave(&motu->spinlock, flags);
+	for (p = 0; p < MOTU_MAX_PORTS; p++) {
+		motu->sched[p].queued = 0;
+		if (motu->clock[p].running) {
+			motu->clock[p].running = false;
+			motu_codec_queue_realtime(&motu->codec, p, 0xfc);
+		}
+	}
+	// the last close may come after the device was unplugged
+	if (!motu->card->shutdown)
+		motu_midi_send(motu);
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+	motu_pm_put(motu);
+
+	return 0;
+}
+
+/* hand out whole struct motu_hwdep_event records */
+static long motu_hwdep_read(struct snd_hwdep *hw, char __user *buf,
+			    long count, loff_t *offset)
+{
+	struct motu *motu = hw->private_data;
+	struct motu_hwdep_event ev;
+	unsigned long flags;
+	long done = 0;
+	int err;
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+
+	if (READ_ONCE(motu->ev_head) == motu->ev_tail &&
+	    (motu->hwdep_file->f_flags & O_NONBLOCK))
+		return -EAGAIN;
+
+	// an unplug wakes the reader up too
+	err = wait_event_interruptible(motu->ev_wait,
+				       READ_ONCE(motu->ev_head) !=
+					       motu->ev_tail ||
+				       motu->card->shutdown);
+	if (err < 0)
+		return err;
+	if (READ_ONCE(motu->ev_head) == motu->ev_tail)
+		return -ENODEV;
+
+	while (count - done >= sizeof(ev)) {
+		spin_lock_irqsave(&motu->in_lock, flags);
+		if (motu->ev_head == motu->ev_tail) {
+			spin_unlock_irqrestore(&motu->in_lock, flags);
+			break;
+		}
+		ev = motu->events[motu->ev_tail & (MOTU_EVENT_RING - 1)];
+		motu->ev_tail++;
+		spin_unlock_irqrestore(&motu->in_lock, flags);
+
+		if (copy_to_user(buf + done, &ev, sizeof(ev)))
+			return done ? done : -EFAULT;
+		done += sizeof(ev);
+	}
+
+	return done;
+}
+
+/*
+ * Each message starts with its status byte and has all its data bytes, a
+ * sysex ends with its F7. Part of a message would leave the device in the
+ * middle of it, between two messages of the rawmidi stream.
+ */
+static bool motu_whole_messages(const u8 *data, int len)
+{
+	int i, j, n;
+
+	for (i = 0; i < len; i += n) {
+		if (data[i] == 0xf0) {
+			for (n = 1; i + n < len && data[i + n] < 0x80; n++)
+				;
+			if (i + n == len || data[i + n] != 0xf7)
+				return false;
+			n++;
+			continue;
+		}
+		n = motu_get_cmd_num_bytes(data[i]);
+		if (n < 1 || data[i] == 0xf7 || i + n > len)
+			return false;
+		for (j = 1; j < n; j++)
+			if (data[i + j] & 0x80)
+				return false;
+	}
+
+	return true;
+}
+
+/*
+ * Take struct motu_hwdep_event records with a CLOCK_MONOTONIC deadline and
+ * one or more complete messages each, and queue them for scheduled output.
+ */
+static long motu_hwdep_write(struct snd_hwdep *hw, const char __user *buf,
+			     long count, loff_t *offset)
+{
+	struct motu *motu = hw->private_data;
+	struct motu_sched_port *sched;
+	struct motu_hwdep_event ev;
+	unsigned long flags;
+	long done = 0;
+	int i;
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+
+	while (count - done >= sizeof(ev)) {
+		if (copy_from_user(&ev, buf + done, sizeof(ev)))
+			return done ? done : -EFAULT;
+		if (ev.port >= motu->n_ports_out || ev.len == 0 ||
+		    ev.len > MOTU_HWDEP_EVENT_DATA ||
+		    !motu_whole_messages(ev.data, ev.len))
+			return done ? done : -EINVAL;
+
+		spin_lock_irqsave(&motu->spinlock, flags);
+		// the timer and the URBs may be gone already
+		if (motu->card->shutdown) {
+			spin_unlock_irqrestore(&motu->spinlock, flags);
+			return done ? done : -ENODEV;
+		}
+		sched = &motu->sched[ev.port];
+		if (sched->queued == MOTU_SCHED_QUEUE) {
+			spin_unlock_irqrestore(&motu->spinlock, flags);
+			return done ? done : -EAGAIN;
+		}
+		for (i = sched->queued;
+		     i > 0 && sched->queue[i - 1].tstamp > ev.tstamp; i--)
+			sched->queue[i] = sched->queue[i - 1];
+		sched->queue[i] = ev;
+		sched->queued++;
+		// what is due already goes out now, not a frame later
+		motu_sched_release(motu, ktime_get_ns());
+		motu_midi_send(motu);
+		motu_sched_arm(motu);
+		spin_unlock_irqrestore(&motu->spinlock, flags);
+
+		done += sizeof(ev);
+	}
+
+	return done;
+}
+
+/*
+ * Send the same messages on several ports. They go straight to the inject
+ * buffers, so the copies leave in the same packet and share its mask bytes
+ * on protocol 1. Either every port takes them or none does.
+ */
+static int motu_hwdep_multicast(struct motu *motu,
+				struct motu_hwdep_multicast __user *arg)
+{
+	struct motu_hwdep_multicast mc;
+	struct motu_sched_port *sched;
+	unsigned long ports, all, flags;
+	bool rt;
+	int p;
+
+	if (copy_from_user(&mc, arg, sizeof(mc)))
+		return -EFAULT;
+	all = BIT(motu->n_ports_out) - 1;
+	ports = mc.ports;
+	if (!ports || (ports & ~all) || mc.len == 0 ||
+	    mc.len > MOTU_HWDEP_EVENT_DATA ||
+	    !motu_whole_messages(mc.data, mc.len))
+		return -EINVAL;
+
+	/* one copy on port 0 reaches all of them */
+	if (motu->out_port_all && (ports | BIT(0)) == all)
+		ports = BIT(0);
+
+	/* a clock or transport byte takes the priority lane */
+	rt = motu_is_realtime(mc.data, mc.len);
+
+	spin_lock_irqsave(&motu->spinlock, flags);
+	if (motu->card->shutdown) {
+		spin_unlock_irqrestore(&motu->spinlock, flags);
+		return -ENODEV;
+	}
+	for_each_set_bit(p, &ports, motu->n_ports_out) {
+		if (rt ? motu->codec.out_rt[p].len + mc.len > MOTU_OUT_RT_SIZE
+		       : motu->sched[p].inject_len + mc.len >
+				 MOTU_SCHED_INJECT) {
+			spin_unlock_irqrestore(&motu->spinlock, flags);
+			return -EAGAIN;
+		}
+	}
+	for_each_set_bit(p, &ports, motu->n_ports_out) {
+		if (rt) {
+			motu_queue_realtime(motu, p, mc.data, mc.len);
+			continue;
+		}
+		sched = &motu->sched[p];
+		memcpy(sched->inject + sched->inject_len, mc.data, mc.len);
+		sched->inject_len += mc.len;
+	}
+	motu_midi_send(motu);
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+
+	return 0;
+}
+
+/* start, stop or retime the clock generators of the selected ports */
+static int motu_hwdep_clock(struct motu *motu,
+			    struct motu_hwdep_clock __user *arg)
+{
+	static const u8 transport[] = {
+		[MOTU_HWDEP_CLOCK_STOP] = 0xfc,
+		[MOTU_HWDEP_CLOCK_START] = 0xfa,
+		[MOTU_HWDEP_CLOCK_CONTINUE] = 0xfb,
+	};
+	struct motu_hwdep_clock cmd;
+	struct motu_clock_port *clock;
+	unsigned long ports, flags;
+	u64 now;
+	int p;
+
+	if (copy_from_user(&cmd, arg, sizeof(cmd)))
+		return -EFAULT;
+	ports = cmd.ports;
+	if (!ports || (ports & ~(BIT(motu->n_ports_out) - 1)) ||
+	    cmd.command > MOTU_HWDEP_CLOCK_TEMPO ||
+	    (cmd.tempo && (cmd.tempo < MOTU_HWDEP_CLOCK_TEMPO_MIN ||
+			   cmd.tempo > MOTU_HWDEP_CLOCK_TEMPO_MAX)))
+		return -EINVAL;
+
+	spin_lock_irqsave(&motu->spinlock, flags);
+	// the timer and the URBs may be gone already
+	if (motu->card->shutdown) {
+		spin_unlock_irqrestore(&motu->spinlock, flags);
+		return -ENODEV;
+	}
+	for_each_set_bit(p, &ports, motu->n_ports_out) {
+		if (!cmd.tempo && !motu->clock[p].tempo &&
+		    cmd.command != MOTU_HWDEP_CLOCK_STOP) {
+			spin_unlock_irqrestore(&motu->spinlock, flags);
+			return -EINVAL;
+		}
+		if (cmd.command != MOTU_HWDEP_CLOCK_TEMPO &&
+		    motu->codec.out_rt[p].len >= MOTU_OUT_RT_SIZE) {
+			spin_unlock_irqrestore(&motu->spinlock, flags);
+			return -EAGAIN;
+		}
+	}
+
+	now = ktime_get_ns();
+	for_each_set_bit(p, &ports, motu->n_ports_out) {
+		clock = &motu->clock[p];
+		if (cmd.command == MOTU_HWDEP_CLOCK_TEMPO) {
+			// the new tempo counts from the next clock
+			if (clock->running) {
+				clock->start = motu_clock_next(clock);
+				clock->tick = 0;
+			}
+		} else {
+			motu_codec_queue_realtime(&motu->codec, p,
+						  transport[cmd.command]);
+			clock->running = cmd.command != MOTU_HWDEP_CLOCK_STOP;
+			// the first clock goes out two frames after the start
+			clock->start = now + 2 * MOTU_FRAME_NS;
+			clock->tick = 0;
+		}
+		if (cmd.tempo)
+			clock->tempo = cmd.tempo;
+	}
+	motu_midi_send(motu);
+	motu_sched_arm(motu);
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+
+	return 0;
+}
+
+/* set or remove the route of an input port */
+static int motu_hwdep_route(struct motu *motu,
+			    struct motu_hwdep_route __user *arg)
+{
+	struct motu_hwdep_route route;
+	struct motu_thru_port *thru;
+	unsigned long flags;
+	bool routed = false;
+	int err, p;
+
+	if (copy_from_user(&route, arg, sizeof(route)))
+		return -EFAULT;
+	if (route.in_port >= motu->n_ports_in ||
+	    (route.out_ports & ~(BIT(motu->n_ports_out) - 1)))
+		return -EINVAL;
+
+	/* routes keep the input running once the hwdep device is closed */
+	mutex_lock(&motu->pm_mutex);
+	if (route.out_ports && !motu->thru_pm) {
+		err = motu_pm_get(motu);
+		if (err < 0) {
+			mutex_unlock(&motu->pm_mutex);
+			return err;
+		}
+		motu->thru_pm = true;
+	}
+
+	spin_lock_irqsave(&motu->in_lock, flags);
+	thru = &motu->thru[route.in_port];
+	thru->out_ports = route.out_ports;
+	thru->channels = route.channels;
+	thru->flags = route.flags;
+	thru->len = 0;
+	for (p = 0; p < motu->n_ports_in; p++)
+		routed |= !!motu->thru[p].out_ports;
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+
+	if (!routed && motu->thru_pm) {
+		motu_pm_put(motu);
+		motu->thru_pm = false;
+	}
+	mutex_unlock(&motu->pm_mutex);
+
+	return 0;
+}
+
+static int motu_hwdep_ioctl(struct snd_hwdep *hw, struct file *file,
+			    unsigned int cmd, unsigned long arg)
+{
+	struct motu *motu = hw->private_data;
+
+	switch (cmd) {
+	case MOTU_HWDEP_IOCTL_MULTICAST:
+		return motu_hwdep_multicast(motu, (void __user *)arg);
+	case MOTU_HWDEP_IOCTL_CLOCK:
+		return motu_hwdep_clock(motu, (void __user *)arg);
+	case MOTU_HWDEP_IOCTL_ROUTE:
+		return motu_hwdep_route(motu, (void __user *)arg);
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+
+static __poll_t motu_hwdep_poll(struct snd_hwdep *hw, struct file *file,
+				poll_table *wait)
+{
+	struct motu *motu = hw->private_data;
+
+	poll_wait(file, &motu->ev_wait, wait);
+
+	if (READ_ONCE(motu->ev_head) != motu->ev_tail)
+		return EPOLLIN | EPOLLRDNORM;
+	if (motu->card->shutdown)
+		return EPOLLHUP | EPOLLERR;
+
+	return 0;
+}
+
+static int motu_init_hwdep(struct motu *motu)
+{
+	struct snd_hwdep *hw;
+	int err;
+
+	err = snd_hwdep_new(motu->card, MOTU_HWDEP_ID, 0, &hw);
+	if (err < 0)
+		return err;
+
+	strncpy(hw->name, motu->card->shortname, sizeof(hw->name));
+	hw->private_data = motu;
+	hw->exclusive = 1;
+	hw->ops.open = motu_hwdep_open;
+	hw->ops.release = motu_hwdep_release;
+	hw->ops.read = motu_hwdep_read;
+	hw->ops.write = motu_hwdep_write;
+	hw->ops.poll = motu_hwdep_poll;
+	hw->ops.ioctl = motu_hwdep_ioctl;
+	hw->ops.ioctl_compat = motu_hwdep_ioctl;
+	motu->hwdep = hw;
+
+	return 0;
+}
+
+/*
+ * One filter mask per input port, MOTU_FILTER_* from motu_codec.h. What it
+ * drops never reaches ALSA and wakes nobody up.
+ */
+static int motu_filter_info(struct snd_kcontrol *kcontrol,
+			    struct snd_ctl_elem_info *uinfo)
+{
+	struct motu *motu = snd_kcontrol_chip(kcontrol);
+
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = motu->n_ports_in;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = MOTU_FILTER_ALL;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int motu_filter_get(struct snd_kcontrol *kcontrol,
+			   struct snd_ctl_elem_value *ucontrol)
+{
+	struct motu *motu = snd_kcontrol_chip(kcontrol);
+	int p;
+
+	for (p = 0; p < motu->n_ports_in; p++)
+		ucontrol->value.integer.value[p] =
+			READ_ONCE(motu->codec.in_ports[p].filter);
+	return 0;
+}
+
+static int motu_filter_put(struct snd_kcontrol *kcontrol,
+			   struct snd_ctl_elem_value *ucontrol)
+{
+	struct motu *motu = snd_kcontrol_chip(kcontrol);
+	struct motu_in_port *in_port;
+	unsigned long flags;
+	long val;
+	int p, changed = 0;
+
+	for (p = 0; p < motu->n_ports_in; p++) {
+		val = ucontrol->value.integer.value[p];
+		if (val < 0 || val > MOTU_FILTER_ALL)
+			return -EINVAL;
+	}
+
+	spin_lock_irqsave(&motu->in_lock, flags);
+	for (p = 0; p < motu->n_ports_in; p++) {
+		in_port = &motu->codec.in_ports[p];
+		val = ucontrol->value.integer.value[p];
+		if (in_port->filter != val) {
+			in_port->filter = val;
+			changed = 1;
+		}
+	}
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+
+	return changed;
+}
+
+static const struct snd_kcontrol_new motu_filter_control = {
+	.iface = SNDRV_CTL_ELEM_IFACE_RAWMIDI,
+	.name = "MIDI Input Filter",
+	.info = motu_filter_info,
+	.get = motu_filter_get,
+	.put = motu_filter_put,
+};
+
+static int motu_init_controls(struct motu *motu)
+{
+	return snd_ctl_add(motu->card,
+			   snd_ctl_new1(&motu_filter_control, motu));
+}
+
+static int motu_init_midi(struct motu *motu)
+{
+	int ret, i;
+	struct snd_rawmidi *rmidi;
+
+	ret = snd_rawmidi_new(motu->card, motu->card->shortname, 0,
+			      motu->n_ports_out, /* output */
+			      motu->n_ports_in,	 /* input */
+			      &rmidi);
+
+	if (ret < 0)
+		return ret;
+
+	strncpy(rmidi->name, motu->card->shortname, sizeof(rmidi->name));
+
+	rmidi->info_flags = SNDRV_RAWMIDI_INFO_DUPLEX;
+	rmidi->private_data = motu;
+
+	rmidi->info_flags |= SNDRV_RAWMIDI_INFO_OUTPUT;
+	snd_rawmidi_set_ops(rmidi, SNDRV_RAWMIDI_STREAM_OUTPUT,
+			    &motu_midi_output);
+
+	rmidi->info_flags |= SNDRV_RAWMIDI_INFO_INPUT;
+	snd_rawmidi_set_ops(rmidi, SNDRV_RAWMIDI_STREAM_INPUT,
+			    &motu_midi_input);
+
+	motu->rmidi = rmidi;
+
+	motu->n_in_urbs = clamp(in_urbs, 1, MAX_IN_URBS);
+	for (i = 0; i < motu->n_in_urbs; i++) {
+		motu->in_urbs[i].motu = motu;
+		motu->in_urbs[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!motu->in_urbs[i].urb) {
+			dev_err(&motu->dev->dev,
+				PREFIX "usb_alloc_urb failed\n");
+			return -ENOMEM;
+		}
+
+		usb_fill_int_urb(motu->in_urbs[i].urb, motu->dev,
+				 usb_rcvintpipe(motu->dev, 0x81),
+				 motu->in_urbs[i].buf, BUFSIZE,
+				 motu_input_complete, &motu->in_urbs[i], 1);
+	}
+
+	motu->n_out_urbs = clamp(out_urbs, 1, MAX_OUT_URBS);
+	for (i = 0; i < motu->n_out_urbs; i++) {
+		struct urb *urb;
+
+		if ((motu->motu_type == express_128) ||
+		    (motu->motu_type == micro_lite))
+			urb = usb_alloc_urb(0, GFP_KERNEL);
+		else
+			urb = usb_alloc_urb(NUM_ISO, GFP_KERNEL);
+
+		if (!urb) {
+			dev_err(&motu->dev->dev,
+				PREFIX "usb_alloc_urb failed\n");
+			return -ENOMEM;
+		}
+		motu->out_urbs[i].motu = motu;
+		motu->out_urbs[i].urb = urb;
+
+		if ((motu->motu_type == express_128) ||
+		    (motu->motu_type == micro_lite)) {
+			usb_fill_int_urb(urb, motu->dev,
+					 usb_sndintpipe(motu->dev, 0x02),
+					 motu->out_urbs[i].buf, BUFSIZE,
+					 motu_output_complete,
+					 &motu->out_urbs[i], 1);
+		} else if ((motu->motu_type == micro_express) ||
+			   (motu->motu_type == express_xt)) {
+			urb->dev = motu->dev;
+			urb->pipe = usb_sndisocpipe(motu->dev, 0x02);
+			urb->transfer_flags = URB_ISO_ASAP;
+			urb->transfer_buffer = motu->out_urbs[i].buf;
+			urb->transfer_buffer_length = BUFSIZE;
+			urb->complete = motu_output_complete;
+			urb->context = &motu->out_urbs[i];
+			urb->start_frame = 0;
+			urb->number_of_packets = 1;
+			urb->iso_frame_desc[0].offset = 0;
+			urb->iso_frame_desc[0].length = BUFSIZE;
+			urb->interval = 1;
+		}
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	/* sanity checks of EPs before actually submitting */
+	if (usb_urb_ep_type_check(motu->in_urbs[0].urb) ||
+	    usb_urb_ep_type_check(motu->out_urbs[0].urb)) {
+		dev_err(&motu->dev->dev, "invalid MIDI EP\n");
+		return -EINVAL;
+	}
+#endif
+
+	motu_init_device(motu);
+	motu_init_proc(motu);
+
+	return 0;
+}
+
+static void motu_free_usb_related_resources(struct motu *motu,
+					    struct usb_interface *interface)
+{
+	unsigned long flags;
+	int i;
+
+	debugfs_remove_recursive(motu->debugfs);
+	motu->debugfs = NULL;
+	hrtimer_cancel(&motu->sched_timer);
+	hrtimer_cancel(&motu->idle_timer);
+
+	/*
+	 * The input ring is in flight from motu_init_device() on, also when
+	 * probe fails later. Their completions use motu, stop them first.
+	 */
+	usb_kill_anchored_urbs(&motu->anchor);
+	for (i = 0; i < MAX_OUT_URBS; i++)
+		usb_kill_urb(motu->out_urbs[i].urb);
+
+	spin_lock_irqsave(&motu->spinlock, flags);
+	motu->out_urbs_free = 0;
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+	for (i = 0; i < MAX_OUT_URBS; i++) {
+		usb_free_urb(motu->out_urbs[i].urb);
+		motu->out_urbs[i].urb = NULL;
+	}
+	for (i = 0; i < MAX_IN_URBS; i++) {
+		usb_free_urb(motu->in_urbs[i].urb);
+		motu->in_urbs[i].urb = NULL;
+	}
+
+	kfree(motu->in_bufs);
+	motu->in_bufs = NULL;
+	kfree(motu->out_bufs);
+	motu->out_bufs = NULL;
+
+	if (motu->intf) {
+		usb_set_intfdata(motu->intf, NULL);
+		motu->intf = NULL;
+	}
+	wake_up(&motu->out_wait);
+	wake_up(&motu->ev_wait);
+}
+
+/* the altsettings MIDI needs, at probe and again after a reset */
+static void motu_set_interfaces(struct motu *motu)
+{
+	if (motu->motu_type == micro_express ||
+	    motu->motu_type == express_xt)
+		usb_set_interface(motu->dev, 0, 0);
+	usb_set_interface(motu->dev, 1, 2);
+}
+
+static int motu_probe(struct usb_interface *interface,
+		      const struct usb_device_id *usb_id)
+{
+	struct snd_card *card;
+	struct motu *motu;
+	unsigned int card_index;
+	char usb_path[32];
+	unsigned int size, out_size;
+	int err, i;
+	struct usb_device *usbdev;
+	char str[64];
+
+	mutex_lock(&devices_mutex);
+
+	for (card_index = 0; card_index < SNDRV_CARDS; ++card_index)
+		if (!test_bit(card_index, devices_used))
+			break;
+
+	if (card_index >= SNDRV_CARDS) {
+		mutex_unlock(&devices_mutex);
+		return -ENOENT;
+	}
+
+	usbdev = interface_to_usbdev(interface);
+
+	if (usb_string(usbdev, usbdev->descriptor.iProduct, str, sizeof(str)) <=
+	    0) {
+		mutex_unlock(&devices_mutex);
+		return -ENODEV;
+	}
+
+	if ((interface->altsetting->desc.bInterfaceNumber != 1) ||
+	    ((usbdev->descriptor.bDeviceSubClass != 3) &&
+	     (usbdev->descriptor.bDeviceSubClass != 1))) {
+		mutex_unlock(&devices_mutex);
+		return -ENOENT;
+	}
+
+	err = snd_card_new(&interface->dev, index[card_index], id[card_index],
+			   THIS_MODULE, sizeof(*motu), &card);
+	if (err < 0) {
+		mutex_unlock(&devices_mutex);
+		return err;
+	}
+
+	motu = card->private_data;
+	motu->dev = usbdev;
+	motu->card = card;
+	motu->card_index = card_index;
+	motu->intf = interface;
+
+	// check iProduct doesn't help: micro lite is 2; micro express also
+	switch (usbdev->descriptor.bDeviceSubClass) {
+	case 1: // micro express
+		if (usbdev->actconfig->desc.bConfigurationValue != 1) {
+			usb_driver_set_configuration(usbdev, 1);
+			return -ENODEV;
+		}
+		if (strstr(str, "Micro Express")) {
+			motu->motu_type = micro_express;
+			motu->n_ports_in = 5;  // 0 is dead for the moment
+			motu->n_ports_out = 7; // 0 is all
+			motu->out_port_all = true;
+		} else {
+			motu->motu_type = express_xt;
+			motu->n_ports_in = 9;  // 0 is dead for the moment
+			motu->n_ports_out = 9; // 0 is all
+			motu->out_port_all = true;
+		}
+		break;
+	case 3: // express 128
+		if (strstr(str, "micro lite")) {
+			motu->motu_type = micro_lite;
+			motu->n_ports_in = 5;
+			motu->n_ports_out = 5;
+		} else {
+			motu->motu_type = express_128;
+			motu->n_ports_in = 8;
+			motu->n_ports_out = 8;
+		}
+		break;
+	default:
+		mutex_unlock(&devices_mutex);
+		return -ENODEV;
+		break;
+	}
+	motu_set_interfaces(motu);
+
+	spin_lock_init(&motu->spinlock);
+	spin_lock_init(&motu->in_lock);
+	mutex_init(&motu->pm_mutex);
+	init_waitqueue_head(&motu->ev_wait);
+	init_waitqueue_head(&motu->out_wait);
+	init_usb_anchor(&motu->anchor);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&motu->sched_timer, motu_sched_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&motu->sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	motu->sched_timer.function = motu_sched_timer;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&motu->idle_timer, motu_idle_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&motu->idle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	motu->idle_timer.function = motu_idle_timer;
+#endif
+
+	// Do I need to initialize this to zero? Or is it already zeroed by
+	// snd_card_new()?
+	for (i = 0; i < MOTU_MAX_PORTS; i++) {
+		motu->in_ports[i].substream = 0;
+		motu->out_ports[i].substream = 0;
+	}
+
+	size = roundup_pow_of_two(clamp(in_buf_size, 16, 65536));
+	motu->in_bufs = kcalloc(MOTU_MAX_PORTS, size, GFP_KERNEL);
+	if (!motu->in_bufs) {
+		err = -ENOMEM;
+		goto probe_error;
+	}
+
+	out_size = roundup_pow_of_two(clamp(out_buf_size, 16, 65536));
+	motu->out_bufs = kcalloc(MOTU_MAX_PORTS, out_size, GFP_KERNEL);
+	if (!motu->out_bufs) {
+		err = -ENOMEM;
+		goto probe_error;
+	}
+
+	motu_codec_init(&motu->codec, motu->n_ports_in, motu->n_ports_out,
+			motu->in_bufs, size, motu->out_bufs, out_size,
+			&motu_codec_ops, motu);
+	motu->codec.running_status = running_status;
+
+	snd_card_set_dev(card, &interface->dev);
+
+	strncpy(card->driver, "snd-motu", sizeof(card->driver));
+	snprintf(card->shortname, sizeof(card->shortname), "MOTU %s", str);
+	usb_make_path(motu->dev, usb_path, sizeof(usb_path));
+	snprintf(motu->card->longname, sizeof(motu->card->longname),
+		 "MOTU midi %s at %s", str, usb_path);
+
+	err = motu_init_midi(motu);
+	if (err < 0)
+		goto probe_error;
+
+	err = motu_init_hwdep(motu);
+	if (err < 0)
+		goto probe_error;
+
+	err = motu_init_controls(motu);
+	if (err < 0)
+		goto probe_error;
+
+	err = snd_card_register(card);
+	if (err < 0)
+		goto probe_error;
+	motu_init_debugfs(motu);
+
+	usb_set_intfdata(interface, motu);
+	set_bit(card_index, devices_used);
+
+	mutex_unlock(&devices_mutex);
+	return 0;
+
+probe_error:
+	dev_info(&motu->dev->dev, PREFIX "error during probing");
+	motu_free_usb_related_resources(motu, interface);
+	snd_card_free(card);
+	mutex_unlock(&devices_mutex);
+	return err;
+}
+
+static void motu_disconnect(struct usb_interface *interface)
+{
+	struct motu *motu = usb_get_intfdata(interface);
+
+	if (!motu)
+		return;
+
+	mutex_lock(&devices_mutex);
+
+	/* make sure that userspace cannot create new requests */
+	snd_card_disconnect(motu->card);
+
+	motu_free_usb_related_resources(motu, interface);
+
+	clear_bit(motu->card_index, devices_used);
+
+	snd_card_free_when_closed(motu->card);
+
+	mutex_unlock(&devices_mutex);
+}
+
+/*
+ * Both for autosuspend, with nothing open, and for system sleep. The URBs
+ * are killed here and motu_resume() builds the input ring up again.
+ */
+static int motu_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct motu *motu = usb_get_intfdata(intf);
+	unsigned long flags;
+	int i;
+
+	if (!motu)
+		return 0;
+
+	/*
+	 * The last output close waits for the URBs in flight before it drops
+	 * its reference. Should it have given up, what they carry still has
+	 * to leave first.
+	 */
+	if (PMSG_IS_AUTO(message) && READ_ONCE(motu->midi_out_active))
+		return -EBUSY;
+
+	spin_lock_irqsave(&motu->in_lock, flags);
+	motu->in_suspended = true;
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+
+	hrtimer_cancel(&motu->sched_timer);
+	hrtimer_cancel(&motu->idle_timer);
+	for (i = 0; i < motu->n_out_urbs; i++)
+		usb_kill_urb(motu->out_urbs[i].urb);
+	usb_kill_anchored_urbs(&motu->anchor);
+	motu->pm_suspends++;
+
+	return 0;
+}
+
+static int motu_resume(struct usb_interface *intf)
+{
+	struct motu *motu = usb_get_intfdata(intf);
+	unsigned long flags;
+	u64 now;
+	int p;
+
+	if (!motu)
+		return 0;
+
+	/*
+	 * Whatever was half parsed or half sent is gone, and the device may
+	 * not remember the running status or the port it was sending to.
+	 */
+	spin_lock_irqsave(&motu->in_lock, flags);
+	spin_lock(&motu->spinlock);
+	motu_codec_resync(&motu->codec);
+	spin_unlock(&motu->spinlock);
+	for (p = 0; p < MOTU_MAX_PORTS; p++)
+		motu->thru[p].len = 0;
+	motu->in_idle = false;
+	motu->in_parked = 0;
+	motu->in_suspended = false;
+	spin_unlock_irqrestore(&motu->in_lock, flags);
+
+	motu_init_device(motu);
+	WRITE_ONCE(motu->pm_resumes, motu->pm_resumes + 1);
+
+	/* running clocks start over, not with every clock they missed */
+	spin_lock_irqsave(&motu->spinlock, flags);
+	now = ktime_get_ns();
+	for (p = 0; p < motu->n_ports_out; p++) {
+		if (!motu->clock[p].running)
+			continue;
+		motu->clock[p].start = now + 2 * MOTU_FRAME_NS;
+		motu->clock[p].tick = 0;
+	}
+	motu_midi_send(motu);
+	motu_sched_arm(motu);
+	spin_unlock_irqrestore(&motu->spinlock, flags);
+
+	return 0;
+}
+
+/* the device was reset while suspended, select the MIDI altsettings again */
+static int motu_reset_resume(struct usb_interface *intf)
+{
+	struct motu *motu = usb_get_intfdata(intf);
+
+	if (motu)
+		motu_set_interfaces(motu);
+
+	return motu_resume(intf);
+}
+
+static int motu_ioctl(struct usb_interface *intf, unsigned int code, void *buf)
+{
+	return (0);
+} /* motu_ioctl */
+
+static struct usb_driver motu_driver = {
+	.name = "snd-motu",
+	.probe = motu_probe,
+	.disconnect = motu_disconnect,
+	.suspend = motu_suspend,
+	.resume = motu_resume,
+	.reset_resume = motu_reset_resume,
+	.unlocked_ioctl = motu_ioctl,
+	.id_table = id_table,
+	.supports_autosuspend = 1,
+};
+
+module_usb_driver(motu_driver);
+
+MODULE_DEVICE_TABLE(usb, id_table);
+MODULE_AUTHOR("vampirefrog, motu-usb@vampi.tech");
+MODULE_AUTHOR("lost-bit, lost-bit@tripod-systems.de");
+MODULE_DESCRIPTION("MOTU midi express devices driver");
+MODULE_LICENSE("GPL");